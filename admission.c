@@ -0,0 +1,248 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <fcgiapp.h>
+
+#include "admission.h"
+#include "debug.h"
+
+// Tunable parameters, see --queue-deadline, --rate, --burst and --limit:
+long queue_deadline_ms = 0;
+double client_rate = 0;
+double client_burst = 0;        // rate, but at least 1
+
+#define MAX_ROUTE_LIMITS 16
+#define ROUTE_NAME_MAX 32
+
+struct route_limit
+{
+  char name[ROUTE_NAME_MAX];    // "*" is any other route
+  int limit;
+  int active;                   // updated atomically
+};
+
+static struct route_limit route_limits[MAX_ROUTE_LIMITS];
+static int number_of_route_limits = 0;
+
+// Clients sharing a slot share a bucket until one of them
+// takes it over, a miss only means a full bucket
+#define CLIENT_BUCKETS 4096
+#define CLIENT_ADDR_MAX 48      // INET6_ADDRSTRLEN and then some
+
+struct client_bucket
+{
+  char addr[CLIENT_ADDR_MAX];
+  double tokens;
+  struct timespec updated;
+};
+
+static struct client_bucket client_buckets[CLIENT_BUCKETS];
+static pthread_mutex_t client_buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// "route:N", e. g. "cgroups:4" or "*:8"
+int
+admission_add_limit (const char *spec)
+{
+  const char *colon = strrchr (spec, ':');
+  if ((NULL == colon) || (colon == spec)
+      || (colon - spec >= ROUTE_NAME_MAX)
+      || (number_of_route_limits == MAX_ROUTE_LIMITS))
+    return -1;
+
+  char *end;
+  long limit = strtol (colon + 1, &end, 10);
+  if ((limit <= 0) || (limit > 1000000) || ('\0' != *end))
+    return -1;
+
+  struct route_limit *l = &route_limits[number_of_route_limits++];
+  memcpy (l->name, spec, colon - spec);
+  l->name[colon - spec] = '\0';
+  l->limit = limit;
+  l->active = 0;
+  return 0;
+}
+
+
+static struct route_limit *
+find_limit (const char *uri)
+{
+  if (0 == number_of_route_limits)
+    return NULL;
+
+  // route is the first component, "cgroups" of "/cgroups/cpu:/"
+  const char *route = (NULL == uri) ? "" : uri + strspn (uri, "/");
+  size_t len = strcspn (route, "/?");
+
+  struct route_limit *any = NULL;
+  for (int i = 0; i < number_of_route_limits; i++)
+    {
+      struct route_limit *l = &route_limits[i];
+      if ((strlen (l->name) == len) && (0 == strncmp (l->name, route, len)))
+        return l;
+      if (0 == strcmp ("*", l->name))
+        any = l;
+    }
+  return any;
+}
+
+
+// X-Request-Start is set by the web server, nginx:
+//   fastcgi_param HTTP_X_REQUEST_START "t=${msec}";
+// seconds since the epoch, with or without a fraction
+static long
+queue_time_ms (FCGX_Request * request)
+{
+  const char *start = FCGX_GetParam ("HTTP_X_REQUEST_START", request->envp);
+  if (NULL == start)
+    return -1;
+  if (0 == strncmp ("t=", start, 2))
+    start += 2;
+
+  char *end;
+  double started = strtod (start, &end);
+  if ((end == start) || (started <= 0))
+    return -1;
+
+  struct timeval now;
+  gettimeofday (&now, NULL);
+  return (long) ((now.tv_sec + now.tv_usec / 1e6 - started) * 1000);
+}
+
+
+// Token bucket of the client, returns seconds to wait, 0 if admitted
+static int
+take_token (const char *addr)
+{
+  size_t h = 2166136261u;
+  for (const char *p = addr; '\0' != *p; p++)
+    h = (h ^ (unsigned char) *p) * 16777619u;
+  struct client_bucket *b = &client_buckets[h % CLIENT_BUCKETS];
+
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  double burst = (client_burst >= 1) ? client_burst :
+    (client_rate >= 1) ? client_rate : 1;
+  int wait = 0;
+
+  pthread_mutex_lock (&client_buckets_lock);
+  if ('\0' == b->addr[0])
+    b->tokens = burst;
+  else
+    {
+      double elapsed = (now.tv_sec - b->updated.tv_sec)
+        + (now.tv_nsec - b->updated.tv_nsec) / 1e9;
+      b->tokens += elapsed * client_rate;
+      if (b->tokens > burst)
+        b->tokens = burst;
+    }
+  // Clients colliding in a slot share its tokens: a fresh bucket
+  // on every switch would let both of them through unlimited
+  if (0 != strncmp (b->addr, addr, sizeof (b->addr)))
+    snprintf (b->addr, sizeof (b->addr), "%s", addr);
+  b->updated = now;
+
+  if (b->tokens >= 1)
+    b->tokens -= 1;
+  else
+    wait = (int) ((1 - b->tokens) / client_rate) + 1;     // rounded up
+  pthread_mutex_unlock (&client_buckets_lock);
+
+  return wait;
+}
+
+
+// uri is what follows the prefix, NULL if there is no prefix.
+// Fills in a->status and the rest if the request is refused.
+bool
+admission_enter (struct admission *a, FCGX_Request * request,
+                 const char *uri)
+{
+  memset (a, 0, sizeof (*a));
+
+  if (queue_deadline_ms > 0)
+    {
+      long queued = queue_time_ms (request);
+      if (queued > queue_deadline_ms)
+        {
+          debug ("queued for %ld ms, refusing", queued);
+          a->status = "503 Service Unavailable";
+          a->reason = "Overloaded, queued for too long";
+          a->retry_after = 1;
+          return false;
+        }
+    }
+
+  if (client_rate > 0)
+    {
+      const char *addr = FCGX_GetParam ("REMOTE_ADDR", request->envp);
+      int wait = take_token ((NULL == addr) ? "" : addr);
+      if (wait > 0)
+        {
+          debug ("client `%s' is over the rate", addr);
+          a->status = "429 Too Many Requests";
+          a->reason = "Too many requests";
+          a->retry_after = wait;
+          return false;
+        }
+    }
+
+  struct route_limit *l = find_limit (uri);
+  if (NULL != l)
+    {
+      if (__sync_add_and_fetch (&l->active, 1) > l->limit)
+        {
+          __sync_sub_and_fetch (&l->active, 1);
+          debug ("route `%s' is at its limit of %d", l->name, l->limit);
+          a->status = "503 Service Unavailable";
+          a->reason = "Overloaded, too many requests in progress";
+          a->retry_after = 1;
+          return false;
+        }
+      a->limit = l;
+    }
+
+  return true;
+}
+
+
+void
+admission_leave (struct admission *a)
+{
+  if (NULL != a->limit)
+    {
+      __sync_sub_and_fetch (&a->limit->active, 1);
+      a->limit = NULL;
+    }
+}
@@ -0,0 +1,52 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <stdbool.h>
+
+#include <fcgiapp.h>
+
+// Requests are refused early, before any cgroup work, when they have
+// waited too long to be served, when their route has too many
+// requests in progress or when their client exceeds its rate.
+struct route_limit;
+
+struct admission
+{
+  struct route_limit *limit;    // slot taken, NULL if none
+  const char *status;           // e. g. "503 Service Unavailable"
+  const char *reason;
+  int retry_after;              // seconds
+};
+
+extern long queue_deadline_ms;  // 0 is off
+extern double client_rate;      // requests per second, 0 is off
+extern double client_burst;
+
+int admission_add_limit (const char *);
+bool admission_enter (struct admission *, FCGX_Request *, const char *);
+void admission_leave (struct admission *);
+
+#endif // _ADMISSION_H
@@ -0,0 +1,662 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcgiapp.h>
+
+#include "aggregate.h"
+#include "arena.h"
+#include "dispatch.h"
+#include "output.h"
+#include "timing.h"
+#include "uri.h"
+#include "debug.h"
+
+// FastCGI client side, one request (id 1) at a time per connection
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_HEADER_LEN 8
+#define FCGI_RESPONDER 1
+#define FCGI_MAX_CONTENT 65535
+
+// Aggregators may query aggregators, but not in a loop
+#define AGGREGATE_MAX_DEPTH 4
+#define AGGREGATE_MAX_BODY (64 * 1024)
+// Responses of all upstreams are held until the last one is done
+#define AGGREGATE_MAX_RESPONSE (8 * 1024 * 1024)
+
+// Tunable parameter, see --upstream-timeout:
+long upstream_timeout_ms = 1000;
+
+struct upstream
+{
+  struct upstream *next;
+  char *name;
+  char *address;
+  long timeout_ms;              // 0 is upstream_timeout_ms
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+};
+
+static struct upstream *upstreams = NULL;
+
+enum exchange_state
+{
+  EXCHANGE_CONNECTING,
+  EXCHANGE_SENDING,
+  EXCHANGE_READING,
+  EXCHANGE_DONE
+};
+
+// A request to one upstream and its response
+struct exchange
+{
+  struct upstream *upstream;
+  enum exchange_state state;
+  int fd;
+  size_t sent;
+  long start_us;
+  long deadline_us;
+  long time_us;
+  const char *error;
+  int app_status;
+  unsigned char header[FCGI_HEADER_LEN];        // record being read
+  size_t header_len;
+  size_t content_left;
+  size_t padding_left;
+  unsigned char end[8];         // FCGI_END_REQUEST body
+  size_t end_len;
+  struct output_buffer response;
+};
+
+
+static long
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+// Same address forms as --socket: a path, or "host:port"
+static int
+upstream_resolve (struct upstream *u)
+{
+  if ((NULL != strchr (u->address, '/')) || (NULL == strchr (u->address, ':')))
+    {
+      struct sockaddr_un *sa = (struct sockaddr_un *) &u->addr;
+      if (strlen (u->address) >= sizeof (sa->sun_path))
+        return -1;
+      sa->sun_family = AF_UNIX;
+      strcpy (sa->sun_path, u->address);
+      u->addr_len = sizeof (*sa);
+      return 0;
+    }
+
+  char *host = strdup (u->address);
+  if (NULL == host)
+    return -1;
+  char *port = strrchr (host, ':');
+  *port++ = '\0';
+  char *h = host;
+  if (('[' == h[0]) && (']' == port[-2]))
+    {
+      h++;
+      port[-2] = '\0';
+    }
+
+  struct addrinfo hints, *ai;
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo (('\0' == *h) ? NULL : h, port, &hints, &ai);
+  free (host);
+  if (0 != rc)
+    {
+      debug ("getaddrinfo(`%s') failed: %s", u->address, gai_strerror (rc));
+      return -1;
+    }
+  memcpy (&u->addr, ai->ai_addr, ai->ai_addrlen);
+  u->addr_len = ai->ai_addrlen;
+  freeaddrinfo (ai);
+  return 0;
+}
+
+
+// "name=address" or "name=address,timeout_ms"
+int
+upstream_add (const char *spec)
+{
+  const char *eq = strchr (spec, '=');
+  if ((NULL == eq) || (eq == spec) || ('\0' == eq[1])
+      || ((size_t) (eq - spec) != strspn (spec, "abcdefghijklmnopqrstuvwxyz"
+                                         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                         "0123456789-_.")))
+    return -1;
+
+  struct upstream *u = (struct upstream *) calloc (1, sizeof (*u));
+  if (NULL == u)
+    return -1;
+  u->name = strndup (spec, eq - spec);
+  u->address = strdup (eq + 1);
+  if ((NULL == u->name) || (NULL == u->address))
+    goto fail;
+
+  char *comma = strrchr (u->address, ',');
+  if ((NULL != comma) && ('\0' != comma[1])
+      && (strlen (comma + 1) == strspn (comma + 1, "0123456789")))
+    {
+      u->timeout_ms = atol (comma + 1);
+      if (u->timeout_ms <= 0)
+        goto fail;
+      *comma = '\0';
+    }
+
+  if (0 != upstream_resolve (u))
+    goto fail;
+
+  struct upstream **tail = &upstreams;
+  while (NULL != *tail)
+    tail = &(*tail)->next;
+  *tail = u;
+  return 0;
+
+fail:
+  free (u->name);
+  free (u->address);
+  free (u);
+  return -1;
+}
+
+
+static unsigned char *
+put_header (unsigned char *p, int type, size_t length)
+{
+  p[0] = FCGI_VERSION_1;
+  p[1] = type;
+  p[2] = 0;                     // request id 1
+  p[3] = 1;
+  p[4] = (length >> 8) & 0xff;
+  p[5] = length & 0xff;
+  p[6] = 0;                     // no padding
+  p[7] = 0;
+  return p + FCGI_HEADER_LEN;
+}
+
+
+static size_t
+param_size (const char *name, const char *value)
+{
+  size_t n = strlen (name), v = strlen (value);
+  return ((n < 128) ? 1 : 4) + ((v < 128) ? 1 : 4) + n + v;
+}
+
+
+static unsigned char *
+put_length (unsigned char *p, size_t length)
+{
+  if (length < 128)
+    *p++ = length;
+  else
+    {
+      *p++ = ((length >> 24) & 0x7f) | 0x80;
+      *p++ = (length >> 16) & 0xff;
+      *p++ = (length >> 8) & 0xff;
+      *p++ = length & 0xff;
+    }
+  return p;
+}
+
+
+static unsigned char *
+put_param (unsigned char *p, const char *name, const char *value)
+{
+  size_t n = strlen (name), v = strlen (value);
+  p = put_length (p, n);
+  p = put_length (p, v);
+  memcpy (p, name, n);
+  memcpy (p + n, value, v);
+  return p + n + v;
+}
+
+
+// The whole request as the records to send to every upstream:
+// BEGIN_REQUEST, PARAMS, STDIN. Without FCGI_KEEP_CONN: libfcgi
+// upstreams read a kept connection with the accept mutex held,
+// an idle one would stop them serving anybody else.
+static unsigned char *
+encode_request (const char *params[], const char *body, size_t body_length,
+                size_t *length)
+{
+  size_t params_length = 0;
+  for (int i = 0; NULL != params[i]; i += 2)
+    params_length += param_size (params[i], params[i + 1]);
+  if (params_length > FCGI_MAX_CONTENT)
+    return NULL;
+
+  size_t stdin_records = (body_length + FCGI_MAX_CONTENT - 1)
+    / FCGI_MAX_CONTENT;
+  *length = FCGI_HEADER_LEN + 8 + 2 * FCGI_HEADER_LEN + params_length
+    + (stdin_records + 1) * FCGI_HEADER_LEN + body_length;
+
+  unsigned char *data = (unsigned char *) arena_alloc (request_arena, *length);
+  if (NULL == data)
+    return NULL;
+
+  unsigned char *p = put_header (data, FCGI_BEGIN_REQUEST, 8);
+  memset (p, 0, 8);
+  p[1] = FCGI_RESPONDER;
+  p += 8;
+
+  p = put_header (p, FCGI_PARAMS, params_length);
+  for (int i = 0; NULL != params[i]; i += 2)
+    p = put_param (p, params[i], params[i + 1]);
+  p = put_header (p, FCGI_PARAMS, 0);
+
+  for (size_t off = 0; off < body_length; off += FCGI_MAX_CONTENT)
+    {
+      size_t n = body_length - off;
+      if (n > FCGI_MAX_CONTENT)
+        n = FCGI_MAX_CONTENT;
+      p = put_header (p, FCGI_STDIN, n);
+      memcpy (p, body + off, n);
+      p += n;
+    }
+  put_header (p, FCGI_STDIN, 0);
+  return data;
+}
+
+
+static void
+exchange_done (struct exchange *x, const char *error)
+{
+  if (NULL != error)
+    {
+      debug ("upstream `%s': %s", x->upstream->name, error);
+      x->error = error;
+    }
+  if (x->fd >= 0)
+    close (x->fd);
+
+  x->fd = -1;
+  x->state = EXCHANGE_DONE;
+  x->time_us = now_us () - x->start_us;
+}
+
+
+// A connection of its own for every exchange
+static void
+exchange_connect (struct exchange *x)
+{
+  struct upstream *u = x->upstream;
+
+  x->sent = 0;
+  x->fd = socket (u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK
+                  | SOCK_CLOEXEC, 0);
+  if (x->fd < 0)
+    {
+      exchange_done (x, strerror (errno));
+      return;
+    }
+
+  if (0 == connect (x->fd, (struct sockaddr *) &u->addr, u->addr_len))
+    x->state = EXCHANGE_SENDING;
+  else if (EINPROGRESS == errno)
+    x->state = EXCHANGE_CONNECTING;
+  else
+    exchange_done (x, strerror (errno));
+}
+
+
+// Takes the records apart: STDOUT goes into the response,
+// END_REQUEST ends the exchange, anything else is skipped
+static void
+exchange_feed (struct exchange *x, const unsigned char *p, size_t n)
+{
+  while ((n > 0) && (EXCHANGE_DONE != x->state))
+    {
+      size_t take;
+
+      if (x->header_len < FCGI_HEADER_LEN)
+        {
+          take = FCGI_HEADER_LEN - x->header_len;
+          take = (take > n) ? n : take;
+          memcpy (x->header + x->header_len, p, take);
+          x->header_len += take;
+          p += take;
+          n -= take;
+          if (FCGI_HEADER_LEN == x->header_len)
+            {
+              x->content_left = (x->header[4] << 8) | x->header[5];
+              x->padding_left = x->header[6];
+              x->end_len = 0;
+            }
+        }
+      else if (x->content_left > 0)
+        {
+          take = (x->content_left > n) ? n : x->content_left;
+          if ((FCGI_STDOUT == x->header[1])
+              && (output_buffer_length (&x->response) + take
+                  > AGGREGATE_MAX_RESPONSE))
+            {
+              exchange_done (x, "Response too large");
+              return;
+            }
+          if (FCGI_STDOUT == x->header[1])
+            FCGX_PutStr ((const char *) p, take, &x->response.stream);
+          else if (FCGI_END_REQUEST == x->header[1])
+            for (size_t i = 0; (i < take) && (x->end_len < 8); i++)
+              x->end[x->end_len++] = p[i];
+          x->content_left -= take;
+          p += take;
+          n -= take;
+        }
+      else
+        {
+          take = (x->padding_left > n) ? n : x->padding_left;
+          x->padding_left -= take;
+          p += take;
+          n -= take;
+        }
+
+      if ((FCGI_HEADER_LEN == x->header_len) && (0 == x->content_left)
+          && (0 == x->padding_left))
+        {
+          x->header_len = 0;
+          if (FCGI_END_REQUEST == x->header[1])
+            {
+              x->app_status = (x->end[0] << 24) | (x->end[1] << 16)
+                | (x->end[2] << 8) | x->end[3];
+              // protocolStatus: the upstream could not take it
+              exchange_done (x, (0 != x->end[4]) ? "Request rejected" :
+                             NULL);
+            }
+        }
+    }
+}
+
+
+static void
+exchange_step (struct exchange *x, const unsigned char *data, size_t length)
+{
+  if (EXCHANGE_CONNECTING == x->state)
+    {
+      int err = 0;
+      socklen_t len = sizeof (err);
+      getsockopt (x->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (0 != err)
+        {
+          exchange_done (x, strerror (err));
+          return;
+        }
+      x->state = EXCHANGE_SENDING;
+    }
+
+  if (EXCHANGE_SENDING == x->state)
+    {
+      ssize_t sent = send (x->fd, data + x->sent, length - x->sent,
+                           MSG_NOSIGNAL);
+      if (sent < 0)
+        {
+          if ((EAGAIN != errno) && (EINTR != errno))
+            exchange_done (x, strerror (errno));
+          return;
+        }
+      x->sent += sent;
+      if (x->sent == length)
+        x->state = EXCHANGE_READING;
+      return;
+    }
+
+  unsigned char buf[16 * 1024];
+  ssize_t got = recv (x->fd, buf, sizeof (buf), 0);
+  if (got < 0)
+    {
+      if ((EAGAIN != errno) && (EINTR != errno))
+        exchange_done (x, strerror (errno));
+    }
+  else if (0 == got)
+    exchange_done (x, "Connection closed");
+  else
+    exchange_feed (x, buf, got);
+}
+
+
+// All exchanges go at once, each until its own deadline
+static void
+exchange_run (struct exchange *xs, int count, const unsigned char *data,
+              size_t length)
+{
+  struct pollfd pfds[count];
+  int index[count];
+
+  while (1)
+    {
+      long now = now_us ();
+      int timeout = -1;
+      int n = 0;
+
+      for (int i = 0; i < count; i++)
+        {
+          struct exchange *x = &xs[i];
+          if (EXCHANGE_DONE == x->state)
+            continue;
+          if (now >= x->deadline_us)
+            {
+              exchange_done (x, "Timed out");
+              continue;
+            }
+
+          int left_ms = (x->deadline_us - now + 999) / 1000;
+          if ((timeout < 0) || (left_ms < timeout))
+            timeout = left_ms;
+          pfds[n].fd = x->fd;
+          pfds[n].events = (EXCHANGE_READING == x->state) ? POLLIN : POLLOUT;
+          pfds[n].revents = 0;
+          index[n++] = i;
+        }
+      if (0 == n)
+        break;
+
+      if ((poll (pfds, n, timeout) < 0) && (EINTR != errno))
+        {
+          const char *error = strerror (errno);
+          for (int j = 0; j < n; j++)
+            exchange_done (&xs[index[j]], error);
+          break;
+        }
+
+      for (int j = 0; j < n; j++)
+        if (0 != pfds[j].revents)
+          exchange_step (&xs[index[j]], data, length);
+    }
+}
+
+
+// Web server's headers are not the client's business,
+// a Status header means the upstream refused the query
+static void
+print_exchange (FCGX_Stream * out, struct exchange *x)
+{
+  FCGX_FPrintF (out, "{upstream: \"%s\", ", x->upstream->name);
+
+  const char *data = (const char *) x->response.data;
+  size_t length = output_buffer_length (&x->response);
+  const char *body = (NULL == x->error) && (0 == x->response.stream.FCGI_errno)
+    ? memmem (data, length, "\r\n\r\n", 4) : NULL;
+
+  if (NULL == body)
+    FCGX_FPrintF (out, "status: \"error\", time_us: %ld, error: \"%s\"}",
+                  x->time_us, (NULL == x->error) ? "Bad response" :
+                  x->error);
+  else
+    {
+      bool refused = (0 == strncasecmp (data, "Status:", 7));
+      for (const char *p = data; !refused && (p < body); p++)
+        refused = ('\n' == *p) && (0 == strncasecmp (p + 1, "Status:", 7));
+
+      body += 4;
+      FCGX_FPrintF (out, "status: \"%s\", time_us: %ld, result: ",
+                    ((0 == x->app_status) && !refused) ? "ok" : "error",
+                    x->time_us);
+      if (body == data + length)
+        FCGX_PutS ("null", out);
+      else
+        FCGX_PutStr (body, data + length - body, out);
+      FCGX_PutS ("}", out);
+    }
+}
+
+
+// Forwards the query (what follows /aggregate/) with the body,
+// if any, to every upstream and lists their responses in order
+void
+fcgi_aggregate (FCGX_Request * request, const char *query)
+{
+  timing_enter (TIMING_PARSE);
+  if (NULL == upstreams)
+    {
+      report_error (request, "No upstreams configured");
+      return;
+    }
+
+  const char *depth_s = FCGX_GetParam ("HTTP_X_AGGREGATE_DEPTH",
+                                       request->envp);
+  int depth = (NULL == depth_s) ? 0 : atoi (depth_s);
+  if ((depth < 0) || (depth >= AGGREGATE_MAX_DEPTH))
+    {
+      report_error (request, "Aggregators nested too deep");
+      return;
+    }
+
+  // Queries of a batch share its environment, but not the body
+  const char *length_s = request->in->isClosed ? NULL :
+    FCGX_GetParam ("CONTENT_LENGTH", request->envp);
+  long body_length = (NULL == length_s) ? 0 : strtol (length_s, NULL, 10);
+  if ((body_length < 0) || (body_length > AGGREGATE_MAX_BODY))
+    {
+      report_error (request, "Body must be at most %d bytes long",
+                    AGGREGATE_MAX_BODY);
+      return;
+    }
+  char *body = (char *) arena_alloc (request_arena, body_length + 1);
+  if ((NULL != body)
+      && (FCGX_GetStr (body, body_length, request->in) != body_length))
+    {
+      report_error (request, "Short read of the body");
+      return;
+    }
+
+  char *uri = (char *) arena_alloc (request_arena,
+                                    uri_prefix_len + strlen (query) + 2);
+  char *depth_next = (char *) arena_alloc (request_arena, 16);
+  char *body_length_s = (char *) arena_alloc (request_arena, 24);
+  if ((NULL == body) || (NULL == uri) || (NULL == depth_next)
+      || (NULL == body_length_s))
+    {
+      report_error (request, "Out of memory");
+      return;
+    }
+  sprintf (uri, "%s/%s", uri_prefix, query);
+  sprintf (depth_next, "%d", depth + 1);
+  sprintf (body_length_s, "%ld", body_length);
+  const char *query_string = strchr (uri, '?');
+  const char *remote_addr = FCGX_GetParam ("REMOTE_ADDR", request->envp);
+
+  // Clients are limited by upstreams as well
+  const char *params[] = {
+    "REQUEST_METHOD", (body_length > 0) ? "POST" : "GET",
+    "REQUEST_URI", uri,
+    "QUERY_STRING", (NULL == query_string) ? "" : query_string + 1,
+    "CONTENT_LENGTH", body_length_s,
+    "HTTP_X_AGGREGATE_DEPTH", depth_next,
+    "REMOTE_ADDR", (NULL == remote_addr) ? "" : remote_addr,
+    NULL
+  };
+  size_t length;
+  unsigned char *data = encode_request (params, body, body_length, &length);
+  if (NULL == data)
+    {
+      report_error (request, "Query too long");
+      return;
+    }
+
+  int count = 0;
+  for (struct upstream * u = upstreams; NULL != u; u = u->next)
+    count++;
+  struct exchange *xs = (struct exchange *)
+    arena_alloc (request_arena, count * sizeof (struct exchange));
+  if (NULL == xs)
+    {
+      report_error (request, "Out of memory");
+      return;
+    }
+
+  debug ("aggregating `%s' from %d upstreams", uri, count);
+  timing_enter (TIMING_BACKEND);
+  long start = now_us ();
+  struct exchange *x = xs;
+  for (struct upstream * u = upstreams; NULL != u; u = u->next, x++)
+    {
+      memset (x, 0, sizeof (*x));
+      x->upstream = u;
+      x->start_us = start;
+      x->deadline_us = start + 1000 *
+        ((0 != u->timeout_ms) ? u->timeout_ms : upstream_timeout_ms);
+      output_buffer_init (&x->response);
+      exchange_connect (x);
+    }
+  exchange_run (xs, count, data, length);
+  timing_enter (TIMING_SERIALIZE);
+
+  FCGX_PutS ("[", request->out);
+  for (int i = 0; i < count; i++)
+    {
+      if (i > 0)
+        FCGX_PutS (",\n ", request->out);
+      print_exchange (request->out, &xs[i]);
+      output_buffer_free (&xs[i].response);
+    }
+  FCGX_PutS ("]", request->out);
+}
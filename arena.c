@@ -0,0 +1,198 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+
+#define ARENA_ALIGN (sizeof (void *) > sizeof (double) ? \
+                     sizeof (void *) : sizeof (double))
+
+// Tunable parameter, see --arena-size:
+size_t arena_size = 64 * 1024;
+
+__thread struct arena *request_arena = NULL;
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct arena
+{
+  struct arena_block *first;    // kept across resets
+  struct arena_block *current;
+};
+
+
+static size_t
+align_up (size_t n)
+{
+  return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+
+static struct arena_block *
+arena_block_new (size_t size)
+{
+  struct arena_block *block =
+    (struct arena_block *) malloc (sizeof (struct arena_block) + size);
+  if (NULL != block)
+    {
+      block->next = NULL;
+      block->size = size;
+      block->used = 0;
+    }
+  return block;
+}
+
+
+struct arena *
+arena_new (size_t size)
+{
+  struct arena *a = (struct arena *) malloc (sizeof (struct arena));
+  if (NULL == a)
+    return NULL;
+
+  a->first = arena_block_new (align_up (size));
+  if (NULL == a->first)
+    {
+      free (a);
+      return NULL;
+    }
+  a->current = a->first;
+  return a;
+}
+
+
+static void
+arena_free_blocks (struct arena_block *block)
+{
+  while (NULL != block)
+    {
+      struct arena_block *next = block->next;
+      free (block);
+      block = next;
+    }
+}
+
+
+void
+arena_destroy (struct arena *a)
+{
+  if (NULL != a)
+    {
+      arena_free_blocks (a->first);
+      free (a);
+    }
+}
+
+
+// Give back everything but the first block,
+// so a typical request never calls malloc()
+void
+arena_reset (struct arena *a)
+{
+  arena_free_blocks (a->first->next);
+  a->first->next = NULL;
+  a->first->used = 0;
+  a->current = a->first;
+}
+
+
+void *
+arena_top (struct arena *a)
+{
+  return a->current->data + a->current->used;
+}
+
+
+// Blocks are appended after the current one, so the current block
+// is always the last one
+void
+arena_rewind (struct arena *a, void *top)
+{
+  struct arena_block *block = a->first;
+  while (!(((char *) top >= block->data)
+           && ((char *) top <= block->data + block->size)))
+    block = block->next;
+
+  arena_free_blocks (block->next);
+  block->next = NULL;
+  block->used = (char *) top - block->data;
+  a->current = block;
+}
+
+
+void *
+arena_alloc (struct arena *a, size_t size)
+{
+  size = align_up (size);
+
+  struct arena_block *block = a->current;
+  if (size > block->size - block->used)
+    {
+      // Oversized chunks get a block of their own
+      size_t block_size = (size > a->first->size) ? size : a->first->size;
+      debug ("new arena block of %zu bytes", block_size);
+      block = arena_block_new (block_size);
+      if (NULL == block)
+        return NULL;
+      a->current->next = block;
+      a->current = block;
+    }
+
+  void *p = block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+
+char *
+arena_strndup (struct arena *a, const char *str, size_t len)
+{
+  char *copy = (char *) arena_alloc (a, len + 1);
+  if (NULL != copy)
+    {
+      memcpy (copy, str, len);
+      copy[len] = '\0';
+    }
+  return copy;
+}
+
+
+char *
+arena_strdup (struct arena *a, const char *str)
+{
+  return arena_strndup (a, str, strlen (str));
+}
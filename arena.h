@@ -0,0 +1,49 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for request-scoped data.
+// Nothing is freed individually, everything goes away on arena_reset().
+struct arena;
+
+extern size_t arena_size;
+
+// Arena of the current worker thread, reset after each request
+extern __thread struct arena *request_arena;
+
+struct arena *arena_new (size_t);
+void arena_destroy (struct arena *);
+void arena_reset (struct arena *);
+
+void *arena_alloc (struct arena *, size_t);
+char *arena_strdup (struct arena *, const char *);
+char *arena_strndup (struct arena *, const char *, size_t);
+
+// Release everything allocated after arena_top() in loops
+void *arena_top (struct arena *);
+void arena_rewind (struct arena *, void *);
+
+#endif // _ARENA_H
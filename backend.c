@@ -0,0 +1,245 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcgroup.h>
+
+#include "backend.h"
+#include "changes.h"
+#include "dircache.h"
+#include "debug.h"
+
+// Reloads must not starve behind a steady stream of requests
+static pthread_rwlock_t backend_lock =
+  PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static bool ready = false;      // changed with the write lock held
+
+// The lock is not recursive, yet a thread waiting for a pool batch
+// may run another request's batch query, which acquires it again.
+// Only the outermost acquire takes it, a reload cannot come between.
+static __thread int depth = 0;
+
+
+// Returns 0 with the read lock held, or a libcgroup error
+int
+backend_acquire (void)
+{
+  if (depth > 0)
+    {
+      depth++;
+      return 0;
+    }
+
+  while (1)
+    {
+      pthread_rwlock_rdlock (&backend_lock);
+      if (ready)
+        {
+          depth = 1;
+          return 0;
+        }
+      pthread_rwlock_unlock (&backend_lock);
+
+      // First use, or the table went away with the last mount
+      int rc = 0;
+      pthread_rwlock_wrlock (&backend_lock);
+      if (!ready)
+        {
+          debug ("initializing libcgroup");
+          rc = cgroup_init ();
+          ready = (0 == rc);
+          if (0 != rc)
+            debug ("cgroup_init() failed: %s", cgroup_strerror (rc));
+        }
+      pthread_rwlock_unlock (&backend_lock);
+      if (0 != rc)
+        return rc;
+    }
+}
+
+
+void
+backend_release (void)
+{
+  if (0 == --depth)
+    pthread_rwlock_unlock (&backend_lock);
+}
+
+
+// Lines of cgroup file systems, "mountpoint super-options" each.
+// Other mounts come and go without a reload.
+static char *
+read_cgroup_mounts (int fd)
+{
+  size_t size = 16 * 1024, length = 0;
+  char *buf = (char *) malloc (size);
+  if (NULL == buf)
+    return NULL;
+
+  lseek (fd, 0, SEEK_SET);
+  while (1)
+    {
+      if (size - length < 4096)
+        {
+          char *bigger = (char *) realloc (buf, 2 * size);
+          if (NULL == bigger)
+            {
+              free (buf);
+              return NULL;
+            }
+          buf = bigger;
+          size *= 2;
+        }
+      ssize_t got = read (fd, buf + length, size - length - 1);
+      if ((got < 0) && (EINTR == errno))
+        continue;
+      if (got < 0)
+        {
+          free (buf);
+          return NULL;
+        }
+      if (0 == got)
+        break;
+      length += got;
+    }
+  buf[length] = '\0';
+
+  // "36 35 98:0 /root /mnt rw,noatime shared:1 - cgroup cgroup rw,cpu"
+  char *out = buf;
+  char *tail = NULL;
+  for (char *line = strtok_r (buf, "\n", &tail); NULL != line;
+       line = strtok_r (NULL, "\n", &tail))
+    {
+      char *sep = strstr (line, " - ");
+      if ((NULL == sep) || (0 != strncmp (sep + 3, "cgroup", 6))
+          || ((' ' != sep[9]) && ('2' != sep[9])))
+        continue;
+
+      // Fifth field is the mount point
+      char *mountpoint = line;
+      for (int i = 0; (i < 4) && (NULL != mountpoint); i++)
+        {
+          mountpoint = strchr (mountpoint, ' ');
+          if (NULL != mountpoint)
+            mountpoint++;
+        }
+      char *options = strrchr (sep, ' ');
+      if ((NULL == mountpoint) || (NULL == options))
+        continue;
+
+      size_t len = strcspn (mountpoint, " ");
+      memmove (out, mountpoint, len);
+      out += len;
+      size_t options_len = strlen (options);
+      memmove (out, options, options_len);
+      out += options_len;
+      *out++ = '\n';
+    }
+  *out = '\0';
+  return buf;
+}
+
+
+static void *
+watcher (void *arg)
+{
+  int fd = (int) (intptr_t) arg;
+  char *mounts = read_cgroup_mounts (fd);
+
+  while (1)
+    {
+      // The kernel flags a change of the mount table with POLLPRI
+      struct pollfd pfd = {.fd = fd,.events = POLLPRI };
+      if (poll (&pfd, 1, -1) < 0)
+        {
+          if (EINTR == errno)
+            continue;
+          debug ("poll() failed: %s", strerror (errno));
+          break;
+        }
+
+      char *now = read_cgroup_mounts (fd);
+      if ((NULL == now) || ((NULL != mounts) && (0 == strcmp (now, mounts))))
+        {
+          free (now);
+          continue;
+        }
+      free (mounts);
+      mounts = now;
+
+      debug ("cgroup mounts have changed");
+      pthread_rwlock_wrlock (&backend_lock);
+      if (ready)
+        {
+          int rc = cgroup_init ();
+          ready = (0 == rc);
+          if (0 != rc)
+            debug ("cgroup_init() failed: %s", cgroup_strerror (rc));
+        }
+      pthread_rwlock_unlock (&backend_lock);
+      // Cached directories may be on a file system gone or hidden
+      dircache_flush ();
+      changes_notify ();
+    }
+
+  free (mounts);
+  close (fd);
+  return NULL;
+}
+
+
+int
+backend_start (void)
+{
+  int fd = open ("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      // Still works, just never reloads
+      debug ("cannot watch mounts: %s", strerror (errno));
+      return 0;
+    }
+
+  pthread_t thread;
+  int rc = pthread_create (&thread, NULL, watcher, (void *) (intptr_t) fd);
+  if (0 != rc)
+    {
+      close (fd);
+      errno = rc;
+      return -1;
+    }
+  pthread_detach (thread);
+  return 0;
+}
@@ -0,0 +1,232 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcgiapp.h>
+
+#include "arena.h"
+#include "batch.h"
+#include "dispatch.h"
+#include "output.h"
+#include "pool.h"
+#include "timing.h"
+#include "debug.h"
+
+// POST body is one query per line, what follows the URI prefix:
+//   cgroups/cpu:/?list&depth=1
+//   cgroups/cpu,blkio:/hello?list-tasks
+#define BATCH_MAX_BODY (64 * 1024)
+#define BATCH_MAX_QUERIES 256
+
+struct batch_query
+{
+  struct batch_query *next;
+  struct pool_task task;
+  const char *query;
+  FCGX_Request request;
+  struct output_buffer result;
+  long time_us;
+  bool failed;
+};
+
+
+static long
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+// Sub-queries run on pool threads, each with an arena of its own.
+// They are timed as a whole, even when run by the request thread.
+static void
+run_query (void *arg)
+{
+  struct batch_query *q = (struct batch_query *) arg;
+  struct arena *saved_arena = request_arena;
+  struct timing *saved_timing = request_timing;
+  bool saved_failed = request_failed;
+  long start = now_us ();
+
+  request_timing = NULL;
+  request_failed = false;
+  request_arena = arena_new (arena_size);
+  char *uri = (NULL == request_arena) ? NULL :
+    arena_strdup (request_arena, q->query);
+
+  if (NULL == uri)
+    report_error (&q->request, "Out of memory");
+  else if (0 == strncmp ("batch", uri + strspn (uri, "/"), 5))
+    report_error (&q->request, "Nested batches are not allowed");
+  else if (0 == strncmp ("debug", uri + strspn (uri, "/"), 5))
+    report_error (&q->request, "Debug requests are not allowed in batches");
+  else
+    route (&q->request, uri);
+
+  arena_destroy (request_arena);
+  q->failed = request_failed;
+  request_arena = saved_arena;
+  request_timing = saved_timing;
+  request_failed = saved_failed;
+
+  q->time_us = now_us () - start;
+  debug ("query `%s' took %ld us", q->query, q->time_us);
+}
+
+
+// Queries come from the client, keep the response valid
+static void
+put_json_string (FCGX_Stream * out, const char *str)
+{
+  FCGX_PutChar ('"', out);
+  for (const char *p = str; '\0' != *p; p++)
+    {
+      if (('"' == *p) || ('\\' == *p))
+        FCGX_PutChar ('\\', out);
+      if ((unsigned char) *p >= ' ')
+        FCGX_PutChar (*p, out);
+    }
+  FCGX_PutChar ('"', out);
+}
+
+
+static char *
+read_body (FCGX_Request * request)
+{
+  const char *method = FCGX_GetParam ("REQUEST_METHOD", request->envp);
+  const char *length_s = FCGX_GetParam ("CONTENT_LENGTH", request->envp);
+
+  if ((NULL == method) || (0 != strcmp ("POST", method)))
+    {
+      report_error (request, "Batch must be POSTed");
+      return NULL;
+    }
+
+  long length = (NULL == length_s) ? -1 : strtol (length_s, NULL, 10);
+  if ((length <= 0) || (length > BATCH_MAX_BODY))
+    {
+      report_error (request, "Batch must be 1 to %d bytes long",
+                    BATCH_MAX_BODY);
+      return NULL;
+    }
+
+  char *body = (char *) arena_alloc (request_arena, length + 1);
+  if (NULL == body)
+    {
+      report_error (request, "Out of memory");
+      return NULL;
+    }
+
+  int got = FCGX_GetStr (body, length, request->in);
+  if (got != length)
+    {
+      report_error (request, "Short read: %d of %ld bytes", got, length);
+      return NULL;
+    }
+  body[length] = '\0';
+  return body;
+}
+
+
+void
+fcgi_batch (FCGX_Request * request)
+{
+  timing_enter (TIMING_PARSE);
+  char *body = read_body (request);
+  if (NULL == body)
+    return;
+
+  // Sub-queries have no body of their own
+  static FCGX_Stream no_input = {.isReader = 1,.isClosed = 1 };
+
+  struct batch_query *queries = NULL;
+  struct batch_query **last = &queries;
+  int number_of_queries = 0;
+
+  char *tail = NULL;
+  for (char *line = strtok_r (body, "\r\n", &tail); NULL != line;
+       line = strtok_r (NULL, "\r\n", &tail))
+    {
+      if (++number_of_queries > BATCH_MAX_QUERIES)
+        {
+          report_error (request, "Too many queries, at most %d allowed",
+                        BATCH_MAX_QUERIES);
+          return;
+        }
+
+      struct batch_query *q = (struct batch_query *)
+        arena_alloc (request_arena, sizeof (struct batch_query));
+      if (NULL == q)
+        {
+          report_error (request, "Out of memory");
+          return;
+        }
+      memset (q, 0, sizeof (*q));
+      q->query = line;
+      q->request.envp = request->envp;
+      q->request.in = &no_input;
+      output_buffer_init (&q->result);
+      q->request.out = &q->result.stream;
+
+      *last = q;
+      last = &q->next;
+    }
+
+  debug ("running %d queries", number_of_queries);
+
+  struct pool_batch batch;
+  pool_batch_init (&batch);
+  for (struct batch_query * q = queries; NULL != q; q = q->next)
+    pool_submit (&batch, &q->task, run_query, q);
+  timing_enter (TIMING_BACKEND);
+  pool_wait (&batch);
+  timing_enter (TIMING_SERIALIZE);
+
+  FCGX_PutS ("[", request->out);
+  for (struct batch_query * q = queries; NULL != q; q = q->next)
+    {
+      if (q != queries)
+        FCGX_PutS (",\n ", request->out);
+      FCGX_PutS ("{query: ", request->out);
+      put_json_string (request->out, q->query);
+      FCGX_FPrintF (request->out, ", status: \"%s\", time_us: %ld, result: ",
+                    q->failed ? "error" : "ok", q->time_us);
+      if (0 == output_buffer_length (&q->result))
+        FCGX_PutS ("null", request->out);
+      else
+        output_buffer_put (&q->result, request->out);
+      output_buffer_free (&q->result);
+      FCGX_PutS ("}", request->out);
+    }
+  FCGX_PutS ("]", request->out);
+}
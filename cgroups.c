@@ -25,17 +25,37 @@ THE SOFTWARE.
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <fcgiapp.h>
 #include <libcgroup.h>
 
+#include "arena.h"
+#include "backend.h"
+#include "cgroups.h"
+#include "changes.h"
+#include "dircache.h"
+#include "dispatch.h"
+#include "history.h"
+#include "output.h"
+#include "pool.h"
+#include "procfs.h"
+#include "provision.h"
+#include "timing.h"
+#include "uri.h"
 #include "debug.h"
 
+// Tunable parameter, see --walk-threshold:
+int cgroups_walk_threshold = 16;
+
 
 // trim traling slashes, but not if str == "/"
 static void
@@ -56,7 +76,7 @@ trim_trailing_slashes (char *str)
 
 
 // Is name in "name1,name2,name3" ?
-static bool
+bool
 controller_is_in_list (const char *controllers, const char *name)
 {
   if ((NULL == controllers) || ('\0' == controllers[0])
@@ -84,56 +104,102 @@ controller_is_in_list (const char *controllers, const char *name)
 static int
 count_controllers (const char *controllers)
 {
-  size_t number_of_controllers = 0;
-  size_t controllers_len = strlen (controllers) + 1;
-  char *tail = NULL;
-  char controllers_copy[controllers_len];
-  memcpy (controllers_copy, controllers, controllers_len);
+  int number_of_controllers = 0;
 
-  char *next_controller = strtok_r (controllers_copy, ",", &tail);
-  do
-    {
-      debug ("next controller `%s'", next_controller);
+  for (const char *p = controllers; '\0' != *p; p++)
+    if ((',' != *p) && ((controllers == p) || (',' == p[-1])))
       number_of_controllers++;
-      next_controller = strtok_r (NULL, ",", &tail);
-    }
-  while (NULL != next_controller);
+
   debug ("number of controllers in `%s': %d", controllers,
          number_of_controllers);
   return number_of_controllers;
 }
 
 
-static bool
-group_has_controller (const char *controller, const char *group)
+// Reads the whole (small) file into the request arena,
+// path is relative to dir unless it is AT_FDCWD
+static char *
+read_file (int dir, const char *path)
 {
-  int rc;
-  void *handle = NULL;
-  int base_level = 0;
-  struct cgroup_file_info info;
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
+  int fd = openat (dir, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      debug ("open(`%s') failed: %s", path, strerror (errno));
+      timing_enter (phase);
+      return NULL;
+    }
 
-  rc =
-    cgroup_walk_tree_begin (controller, group, 0, &handle, &info,
-                            &base_level);
+  size_t size = 1024;
+  size_t len = 0;
+  char *buf = (char *) arena_alloc (request_arena, size);
 
-  if (0 == rc)
+  while (NULL != buf)
     {
-      cgroup_walk_tree_end (&handle);
-      if (CGROUP_FILE_TYPE_DIR == info.type)
-        return true;
+      ssize_t rc = read (fd, buf + len, size - len - 1);
+      if (rc < 0)
+        {
+          if (EINTR == errno)
+            continue;
+          debug ("read(`%s') failed: %s", path, strerror (errno));
+          buf = NULL;
+          break;
+        }
+      if (0 == rc)
+        {
+          buf[len] = '\0';
+          break;
+        }
+      len += rc;
+      if (len == size - 1)
+        {
+          // /proc files have no size, grow and go on
+          char *bigger = (char *) arena_alloc (request_arena, size * 2);
+          if (NULL != bigger)
+            memcpy (bigger, buf, len);
+          buf = bigger;
+          size *= 2;
+        }
     }
 
-  return false;
+  close (fd);
+  timing_enter (phase);
+  return buf;
+}
+
+
+// A cached directory of the group, or a single openat() from the mount point
+static bool
+group_dir_exists (const char *mountpoint, const char *group)
+{
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
+  struct dircache_entry *dir = dircache_get (mountpoint, group);
+  if (NULL != dir)
+    dircache_put (dir);
+  timing_enter (phase);
+  return (NULL != dir);
+}
+
+
+static bool
+group_has_controller (const char *controller, const char *group)
+{
+  char *mountpoint = NULL;
+  if (0 != cgroup_get_subsys_mount_point (controller, &mountpoint))
+    return false;
+  bool ret = group_dir_exists (mountpoint, group);
+  free (mountpoint);
+  return ret;
 }
 
 
 static bool
 group_exists (const char *controllers, const char *group)
 {
-  size_t controllers_len = strlen (controllers) + 1;
   char *tail = NULL;
-  char controllers_copy[controllers_len];
-  memcpy (controllers_copy, controllers, controllers_len);
+  char *controllers_copy = arena_strdup (request_arena, controllers);
+  if (NULL == controllers_copy)
+    return false;
 
   char *controller = strtok_r (controllers_copy, ",", &tail);
   do
@@ -152,28 +218,36 @@ static bool
 group_has_pid (const char *controllers, const char *group, pid_t pid)
 {
   bool ret = true;
+  void *top = arena_top (request_arena);      // called for every pid
 
   char proc_cgroup_path[sizeof ("/proc/2147483647/cgroup")];
-  char pid_controllers[FILENAME_MAX];
 
   snprintf (proc_cgroup_path, sizeof (proc_cgroup_path), "/proc/%d/cgroup",
             pid);
   debug ("reading `%s'", proc_cgroup_path);
 
-  FILE *proc_cgroup_file = fopen (proc_cgroup_path, "r");
-  if (NULL != proc_cgroup_file)
+  // Lines are "hierarchy-ID:controller-list:cgroup-path"
+  char *proc_cgroup = read_file (AT_FDCWD, proc_cgroup_path);
+  char *pid_controllers = (NULL != proc_cgroup) ?
+    (char *) arena_alloc (request_arena, strlen (proc_cgroup) + 1) : NULL;
+  if (NULL != pid_controllers)
     {
       char *next_controller = pid_controllers;
-      while (!feof (proc_cgroup_file))
+      char *line_tail = NULL;
+      char *line = strtok_r (proc_cgroup, "\n", &line_tail);
+      while (NULL != line)
         {
-          char cntrls[FILENAME_MAX];
-          char path[FILENAME_MAX];
-          int rc = fscanf (proc_cgroup_file, "%*d:%[^:]:%s\n", cntrls, path);
-          if (2 != rc)
+          char *cntrls = strchr (line, ':');
+          char *path = (NULL != cntrls) ? strchr (cntrls + 1, ':') : NULL;
+          if ((NULL == path) || (cntrls + 1 == path))
             {
-              debug ("fscanf() returned %d != 2", rc);
+              debug ("skipping line `%s'", line);
+              line = strtok_r (NULL, "\n", &line_tail);
               continue;
             }
+          cntrls++;
+          *path = '\0';
+          path++;
 
           debug ("pid %d is in `%s:%s'", pid, cntrls, path);
           if (0 == strcmp (path, group))
@@ -187,18 +261,22 @@ group_has_pid (const char *controllers, const char *group, pid_t pid)
               memcpy (next_controller, cntrls, l);
               next_controller += l;
             }
+          line = strtok_r (NULL, "\n", &line_tail);
         }
-      fclose (proc_cgroup_file);
 
       *next_controller = '\0';
       debug ("all pid %d controllers `%s'", pid, pid_controllers);
 
       // all controllers must be in pid_controllers:
-      size_t l = strlen (controllers) + 1;
-      char controllers_copy[l];
       char *tail = NULL;
-      memcpy (controllers_copy, controllers, l);
-      next_controller = strtok_r (controllers_copy, ",", &tail);
+      char *controllers_copy = arena_strdup (request_arena, controllers);
+      if (NULL == controllers_copy)
+        {
+          ret = false;
+          next_controller = NULL;
+        }
+      else
+        next_controller = strtok_r (controllers_copy, ",", &tail);
       while (NULL != next_controller)
         {
           debug ("checking controller `%s'", next_controller);
@@ -212,10 +290,12 @@ group_has_pid (const char *controllers, const char *group, pid_t pid)
     }
   else
     {
-      debug ("fopen() failed: %s ", strerror (errno));
+      debug ("failed to read `%s'", proc_cgroup_path);
       ret = false;
     }
 
+  arena_rewind (request_arena, top);
+
   debug ("pid %d is%s under `%s' controllers", pid, (ret ? "" : " not"),
          controllers);
   return ret;
@@ -233,6 +313,8 @@ fcgi_cgroups_list_controllers_by_mountpoint (FCGX_Request * request,
 
   FCGX_PutS ("[", request->out);
 
+  // a few short names, not worth switching phases
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
   rc = cgroup_get_controller_begin (&handle, &controller);
   debug ("cgroup_get_controller_begin() returned %d", rc);
 
@@ -252,70 +334,426 @@ fcgi_cgroups_list_controllers_by_mountpoint (FCGX_Request * request,
   debug ("exit from loop with %d", rc);
 
   cgroup_get_controller_end (&handle);
+  timing_enter (phase);
 
   FCGX_PutS ("]", request->out);
 }
 
 
+#define FIELD_CONTROLLERS 1
+#define FIELD_GROUPS 2
+#define FIELD_COUNT 4
+
+// ?depth=N&prefix=/a/b&name=glob&fields=controllers,groups,count
+struct walk_filter
+{
+  int depth;                    // levels below the path, -1 is unlimited
+  const char *prefix;           // group path prefix
+  const char *name;             // glob for the last path component
+  int fields;
+};
+
+
+static int
+count_levels (const char *path)
+{
+  int levels = 0;
+  for (const char *p = path; '\0' != *p; p++)
+    if (('/' != *p) && ((path == p) || ('/' == p[-1])))
+      levels++;
+  return levels;
+}
+
+
+// Is group b the same as a or under it?
+static bool
+group_is_under (const char *a, const char *b)
+{
+  size_t len = strlen (a);
+  while ((len > 0) && ('/' == a[len - 1]))
+    len--;
+  return (0 == strncmp (a, b, len)) && (('\0' == b[len]) || ('/' == b[len]));
+}
+
+
+// Runs on pool threads too, so no request arena here
+static bool
+group_matches (const struct walk_filter *filter, const char *rel_path)
+{
+  if (NULL == filter->name)
+    return true;
+
+  // walk roots come with a trailing slash
+  size_t len = strlen (rel_path);
+  while ((len > 0) && ('/' == rel_path[len - 1]))
+    len--;
+
+  size_t start = len;
+  while ((start > 0) && ('/' != rel_path[start - 1]))
+    start--;
+
+  char name[NAME_MAX + 1];
+  if (len - start > NAME_MAX)
+    return false;
+  memcpy (name, rel_path + start, len - start);
+  name[len - start] = '\0';
+
+  return 0 == fnmatch (filter->name, name, 0);
+}
+
+
+// Writes groups under path as `"/a", "/a/b"', group_count is shared
+// by consecutive calls to get the separators right.
+// Nothing is written if out is NULL, groups are only counted.
+// libcgroup reports the walk root with a trailing slash,
+// subtree walks drop it to look like a part of a bigger walk.
 static void
-fcgi_cgroups_list_groups (FCGX_Request * request, const char *controller,
-                          const char *path, const char *mountpoint)
+walk_groups (FCGX_Stream * out, const char *controller, const char *path,
+             const char *mountpoint, int depth, bool subtree,
+             const struct walk_filter *filter, int *group_count)
 {
   int rc;
   void *handle = NULL;
   int base_level = 0;
   struct cgroup_file_info info;
-  int group_count = 0;
-
-  FCGX_PutS ("[", request->out);
 
   size_t mountpoint_len = strlen (mountpoint);
 
+  // libcgroup lists `depth' levels below the root, no more
+  // (0 is unlimited, so the root alone is the first node)
+  int walk_depth = (depth < 0) ? 0 : depth;
+
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
   rc =
-    cgroup_walk_tree_begin (controller, path, 0, &handle, &info, &base_level);
+    cgroup_walk_tree_begin (controller, path, walk_depth, &handle, &info,
+                            &base_level);
   debug ("cgroup_walk_tree_begin() returned %d", rc);
 
+  int root_level = (0 == rc) ? info.depth : 0;
   while (0 == rc)
     {
-      if (CGROUP_FILE_TYPE_DIR == info.type)
+      if ((CGROUP_FILE_TYPE_DIR == info.type)
+          && ((depth < 0) || (info.depth - root_level <= depth)))
         {
-          if (group_count > 0)
-            FCGX_PutS (", ", request->out);
-
           const char *rel_path = info.full_path + mountpoint_len;
           while ('/' == *rel_path)
             rel_path++;
 
-          FCGX_FPrintF (request->out, "\"/%s\"", rel_path);
-
           debug ("full path = `%s', rel path = `%s'", info.full_path,
                  rel_path);
 
-          group_count++;
+          int len = strlen (rel_path);
+          if (subtree && (info.depth == root_level))
+            while ((len > 0) && ('/' == rel_path[len - 1]))
+              len--;
+
+          if (group_matches (filter, rel_path))
+            {
+              if (NULL != out)
+                {
+                  timing_enter (phase);
+                  if (*group_count > 0)
+                    FCGX_PutS (", ", out);
+                  FCGX_FPrintF (out, "\"/%.*s\"", len, rel_path);
+                  timing_enter (TIMING_BACKEND);
+                }
+              (*group_count)++;
+            }
         }
-      rc = cgroup_walk_tree_next (0, &handle, &info, base_level);
+      if (0 == depth)
+        break;
+      rc = cgroup_walk_tree_next (walk_depth, &handle, &info, base_level);
     }
   debug ("exit from loop with %d", rc);
 
   cgroup_walk_tree_end (&handle);
+  timing_enter (phase);
+}
 
-  FCGX_PutS ("]", request->out);
+
+struct subtree_walk
+{
+  struct subtree_walk *next;
+  struct pool_task task;
+  const char *controller;
+  const char *path;
+  const char *mountpoint;
+  int depth;
+  const struct walk_filter *filter;
+  bool buffered;
+  int group_count;
+  struct output_buffer groups;
+};
+
+struct hierarchy
+{
+  struct hierarchy *next;
+  const char *controller;       // any controller of this hierarchy
+  const char *mountpoint;
+  bool split;                   // walked as root + subtrees
+  const char *root;             // NULL if the walk root does not exist
+  bool root_listed;
+  struct subtree_walk *subtrees;
+};
+
+// Where and what to walk for the request
+struct walk_plan
+{
+  const struct walk_filter *filter;
+  const char *root;             // walk root, deeper than the path for ?prefix=
+  int root_level;               // levels of root below the path
+  const char *child_prefix;     // walk only subgroups starting with it
+  bool root_listed;             // does root itself match ?prefix=
+  bool empty;                   // nothing can match
+};
+
+
+static void
+walk_subtree (void *arg)
+{
+  struct subtree_walk *w = (struct subtree_walk *) arg;
+  walk_groups ((w->filter->fields & FIELD_GROUPS) ? &w->groups.stream : NULL,
+               w->controller, w->path, w->mountpoint, w->depth, true,
+               w->filter, &w->group_count);
+}
+
+
+// ?prefix=/a/b/c walks subgroups of /a/b starting with "c",
+// instead of the whole tree under the path
+static void
+plan_walk (struct walk_plan *plan, const char *path,
+           const struct walk_filter *filter)
+{
+  memset (plan, 0, sizeof (*plan));
+  plan->filter = filter;
+  plan->root = path;
+  plan->root_listed = true;
+
+  const char *prefix = filter->prefix;
+  if ((NULL == prefix) || ('/' != prefix[0]))
+    return;
+
+  const char *slash = strrchr (prefix, '/');
+  char *prefix_dir = arena_strndup (request_arena, prefix,
+                                    (slash == prefix) ? 1 : slash - prefix);
+  if (NULL == prefix_dir)
+    return;
+
+  if (group_is_under (path, prefix_dir))
+    {
+      plan->root = prefix_dir;
+      plan->root_level = count_levels (prefix_dir) - count_levels (path);
+      plan->child_prefix = slash + 1;
+      plan->root_listed = ('\0' == plan->child_prefix[0]) &&
+        (0 == strcmp (prefix_dir, prefix));
+    }
+  else if (group_is_under (prefix_dir, path))
+    {
+      // The path is deeper, its first component
+      // below prefix_dir must match the rest of the prefix
+      const char *p = path + strlen (prefix_dir);
+      while ('/' == *p)
+        p++;
+      plan->empty = (0 != strncmp (p, slash + 1, strlen (slash + 1)));
+    }
+  else
+    plan->empty = true;
+
+  debug ("walk root `%s', subgroups `%s*'%s", plan->root,
+         plan->child_prefix ? plan->child_prefix : "",
+         plan->empty ? ", nothing to walk" : "");
+}
+
+
+// Lists direct subgroups of the walk root matching the plan
+// in the order a full walk would visit them, returns their number
+static int
+split_hierarchy (struct hierarchy *h, const struct walk_plan *plan)
+{
+  int rc;
+  void *handle = NULL;
+  int base_level = 0;
+  struct cgroup_file_info info;
+  int count = 0;
+  struct subtree_walk **last = &h->subtrees;
+  int depth = plan->filter->depth;
+
+  size_t mountpoint_len = strlen (h->mountpoint);
+  size_t child_prefix_len =
+    (NULL == plan->child_prefix) ? 0 : strlen (plan->child_prefix);
+
+  h->split = true;
+  h->root_listed = plan->root_listed
+    && ((depth < 0) || (plan->root_level <= depth));
+
+  rc = cgroup_walk_tree_begin (h->controller, plan->root, 1, &handle, &info,
+                               &base_level);
+  while (0 == rc)
+    {
+      if (CGROUP_FILE_TYPE_DIR == info.type)
+        {
+          const char *rel_path = info.full_path + mountpoint_len;
+          while ('/' == *rel_path)
+            rel_path++;
+
+          if (NULL == h->root)
+            h->root = arena_strdup (request_arena, rel_path);
+          else if (((depth < 0) || (plan->root_level + 1 <= depth))
+                   && (0 == strncmp (info.path, plan->child_prefix ?
+                                     plan->child_prefix : "",
+                                     child_prefix_len)))
+            {
+              struct subtree_walk *w = (struct subtree_walk *)
+                arena_alloc (request_arena, sizeof (struct subtree_walk));
+              char *sub_path = (char *)
+                arena_alloc (request_arena, strlen (rel_path) + 2);
+              if ((NULL == w) || (NULL == sub_path))
+                {
+                  count = -1;
+                  break;
+                }
+              sub_path[0] = '/';
+              strcpy (sub_path + 1, rel_path);
+
+              memset (w, 0, sizeof (*w));
+              w->controller = h->controller;
+              w->path = sub_path;
+              w->mountpoint = h->mountpoint;
+              w->depth = (depth < 0) ? -1 : depth - plan->root_level - 1;
+              w->filter = plan->filter;
+              *last = w;
+              last = &w->next;
+              count++;
+            }
+        }
+      rc = cgroup_walk_tree_next (1, &handle, &info, base_level);
+    }
+  cgroup_walk_tree_end (&handle);
+
+  debug ("`%s:%s' has %d subgroups to walk", h->controller, plan->root,
+         count);
+  return count;
 }
 
 
+// Walks subtrees of large hierarchies on the pool,
+// small ones are walked later in the request thread
 static void
-fcgi_cgroups_heirarchy (FCGX_Request * request, const char *controller,
-                        const char *path, const char *mountpoint)
+split_walks (struct hierarchy *hierarchies, const struct walk_plan *plan)
 {
+  int total = 0;
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
+
+  for (struct hierarchy * h = hierarchies; NULL != h; h = h->next)
+    {
+      int count = split_hierarchy (h, plan);
+      if (count < 0)
+        {
+          timing_enter (phase);
+          return;
+        }
+      total += count;
+    }
+
+  if (!pool_running () || (total < cgroups_walk_threshold))
+    {
+      debug ("%d subgroups, walking in one thread", total);
+      timing_enter (phase);
+      return;
+    }
+
+  debug ("walking %d subgroups in parallel", total);
+
+  struct pool_batch batch;
+  pool_batch_init (&batch);
+  for (struct hierarchy * h = hierarchies; NULL != h; h = h->next)
+    for (struct subtree_walk * w = h->subtrees; NULL != w; w = w->next)
+      {
+        output_buffer_init (&w->groups);
+        w->buffered = true;
+        pool_submit (&batch, &w->task, walk_subtree, w);
+      }
+  pool_wait (&batch);
+  timing_enter (phase);
+}
+
+
+// Root group and subtrees in the walk order
+static void
+merge_groups (FCGX_Stream * out, const struct hierarchy *h,
+              const struct walk_plan *plan, int *group_count)
+{
+  if ((NULL == h->root) || plan->empty)
+    return;
+
+  if (h->root_listed && group_matches (plan->filter, h->root))
+    {
+      if (NULL != out)
+        FCGX_FPrintF (out, "\"/%s\"", h->root);
+      (*group_count)++;
+    }
+
+  for (struct subtree_walk * w = h->subtrees; NULL != w; w = w->next)
+    {
+      if (!w->buffered)
+        walk_groups (out, w->controller, w->path, w->mountpoint, w->depth,
+                     true, w->filter, group_count);
+      else
+        {
+          if ((NULL != out) && (w->group_count > 0))
+            {
+              if (*group_count > 0)
+                FCGX_PutS (", ", out);
+              output_buffer_put (&w->groups, out);
+            }
+          *group_count += w->group_count;
+          output_buffer_free (&w->groups);
+        }
+    }
+}
+
+
+static void
+fcgi_cgroups_heirarchy (FCGX_Request * request, const struct hierarchy *h,
+                        const struct walk_plan *plan)
+{
+  int fields = plan->filter->fields;
+  int group_count = 0;
+  FCGX_Stream *groups_out = (fields & FIELD_GROUPS) ? request->out : NULL;
+
   FCGX_PutS ("{", request->out);
 
-  FCGX_PutS ("controllers: ", request->out);
-  fcgi_cgroups_list_controllers_by_mountpoint (request, mountpoint);
+  if (fields & FIELD_CONTROLLERS)
+    {
+      FCGX_PutS ("controllers: ", request->out);
+      fcgi_cgroups_list_controllers_by_mountpoint (request, h->mountpoint);
+    }
 
-  FCGX_PutS (", ", request->out);
+  if (fields & FIELD_GROUPS)
+    {
+      if (fields & FIELD_CONTROLLERS)
+        FCGX_PutS (", ", request->out);
+      FCGX_PutS ("groups: [", request->out);
+    }
 
-  FCGX_PutS ("groups: ", request->out);
-  fcgi_cgroups_list_groups (request, controller, path, mountpoint);
+  if (fields & (FIELD_GROUPS | FIELD_COUNT))
+    {
+      if (h->split)
+        merge_groups (groups_out, h, plan, &group_count);
+      else if (!plan->empty)
+        walk_groups (groups_out, h->controller, plan->root, h->mountpoint,
+                     plan->filter->depth, false, plan->filter, &group_count);
+    }
+
+  if (fields & FIELD_GROUPS)
+    FCGX_PutS ("]", request->out);
+
+  if (fields & FIELD_COUNT)
+    {
+      if (fields & (FIELD_CONTROLLERS | FIELD_GROUPS))
+        FCGX_PutS (", ", request->out);
+      FCGX_FPrintF (request->out, "count: %d", group_count);
+    }
 
   FCGX_PutS ("}", request->out);
 }
@@ -323,20 +761,21 @@ fcgi_cgroups_heirarchy (FCGX_Request * request, const char *controller,
 
 static void
 fcgi_cgroups_list_hierarhies (FCGX_Request * request, const char *controllers,
-                              const char *path)
+                              const char *path,
+                              const struct walk_filter *filter)
 {
   int rc;
   void *handle = NULL;
   struct cgroup_mount_point controller;
-  char mountpoint[FILENAME_MAX];        // it's a sizeof cgroup_mount_point.path
-  int hier_count = 0;
+  const char *mountpoint = "";
+  struct hierarchy *hierarchies = NULL;
+  struct hierarchy **last = &hierarchies;
 
   FCGX_PutS ("[", request->out);
 
-  mountpoint[0] = '\0';
-
   debug ("controllers `%s', path `%s'", controllers, path);
 
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
   rc = cgroup_get_controller_begin (&handle, &controller);
   debug ("cgroup_get_controller_begin() returned %d", rc);
 
@@ -347,7 +786,7 @@ fcgi_cgroups_list_hierarhies (FCGX_Request * request, const char *controllers,
 
       bool use_controller =
         controller_is_in_list (controllers, controller.name)
-        && group_has_controller (controller.name, path);
+        && group_dir_exists (controller.path, path);
 
       if (use_controller)
         {
@@ -355,12 +794,19 @@ fcgi_cgroups_list_hierarhies (FCGX_Request * request, const char *controllers,
           // XXX use stat() and st_dev/st_ino ?
           if (0 != strcmp (mountpoint, controller.path))        // new mount point (hierarchy)
             {
-              strcpy (mountpoint, controller.path);
-              if (hier_count > 0)
-                FCGX_PutS (", ", request->out);
-              fcgi_cgroups_heirarchy (request, controller.name, path,
-                                      mountpoint);
-              hier_count++;
+              struct hierarchy *h = (struct hierarchy *)
+                arena_alloc (request_arena, sizeof (struct hierarchy));
+              mountpoint = arena_strdup (request_arena, controller.path);
+              if ((NULL == h) || (NULL == mountpoint))
+                {
+                  debug ("out of memory");
+                  break;
+                }
+              memset (h, 0, sizeof (*h));
+              h->controller = arena_strdup (request_arena, controller.name);
+              h->mountpoint = mountpoint;
+              *last = h;
+              last = &h->next;
             }
         }
       rc = cgroup_get_controller_next (&handle, &controller);
@@ -368,129 +814,681 @@ fcgi_cgroups_list_hierarhies (FCGX_Request * request, const char *controllers,
   debug ("exit from loop with %d", rc);
 
   cgroup_get_controller_end (&handle);
+  timing_enter (phase);
+
+  struct walk_plan plan;
+  plan_walk (&plan, path, filter);
+
+  // Only controllers requested, do not walk at all
+  bool need_walk = (filter->fields & (FIELD_GROUPS | FIELD_COUNT))
+    && !plan.empty;
+  if (need_walk && (pool_running () || (NULL != plan.child_prefix)))
+    split_walks (hierarchies, &plan);
+
+  int hier_count = 0;
+  for (struct hierarchy * h = hierarchies; NULL != h; h = h->next)
+    {
+      if (hier_count > 0)
+        FCGX_PutS (", ", request->out);
+      fcgi_cgroups_heirarchy (request, h, &plan);
+      hier_count++;
+    }
 
   FCGX_PutS ("]", request->out);
 }
 
 
+#define TASK_COMM 1
+#define TASK_STATE 2
+#define TASK_RSS 4
+#define TASK_UTIME 8
+#define TASK_THREADS 16
+
+static int
+compare_pids (const void *a, const void *b)
+{
+  pid_t x = *(const pid_t *) a;
+  pid_t y = *(const pid_t *) b;
+  return (x > y) - (x < y);
+}
+
+
+// Quotes and backslashes may be in process names
+static void
+print_comm (FCGX_Stream * out, const char *comm)
+{
+  FCGX_PutS ("\"", out);
+  for (const char *c = comm; '\0' != *c; c++)
+    {
+      if (('"' == *c) || ('\\' == *c))
+        FCGX_PutChar ('\\', out);
+      FCGX_PutChar (((unsigned char) *c < ' ') ? '?' : *c, out);
+    }
+  FCGX_PutS ("\"", out);
+}
+
+
+// Bare pids, or objects with the fields from /proc.
+// Tasks gone since listing are left out.
+static void
+print_tasks (FCGX_Request * request, const pid_t * pids, int count,
+             int fields, bool processes)
+{
+  int printed = 0;
+
+  for (int i = 0; i < count; i++)
+    {
+      struct proc_task task;
+      if (0 != fields)
+        {
+          enum timing_phase phase = timing_enter (TIMING_BACKEND);
+          int rc = proc_task (pids[i], processes, &task);
+          timing_enter (phase);
+          if (0 != rc)
+            {
+              debug ("no details of task %d: %s", pids[i], strerror (rc));
+              continue;
+            }
+        }
+
+      if (printed > 0)
+        FCGX_PutS (", ", request->out);
+      printed++;
+
+      if (0 == fields)
+        {
+          FCGX_FPrintF (request->out, "%d", pids[i]);
+          continue;
+        }
+
+      FCGX_FPrintF (request->out, "{pid: %d", pids[i]);
+      if (fields & TASK_COMM)
+        {
+          FCGX_PutS (", comm: ", request->out);
+          print_comm (request->out, task.comm);
+        }
+      if (fields & TASK_STATE)
+        FCGX_FPrintF (request->out, ", state: \"%c\"", task.state);
+      if (fields & TASK_RSS)
+        FCGX_FPrintF (request->out, ", rss: %llu", task.rss);
+      if (fields & TASK_UTIME)
+        FCGX_FPrintF (request->out, ", utime: %llu", task.utime);
+      if (fields & TASK_THREADS)
+        FCGX_FPrintF (request->out, ", threads: %ld", task.threads);
+      FCGX_PutS ("}", request->out);
+    }
+}
+
+
 static void
 fcgi_cgroups_list_tasks (FCGX_Request * request, const char *controllers,
-                         const char *path)
+                         const char *path, int fields, bool processes)
 {
-  int rc;
-  pid_t pid;
-  void *handle = NULL;
-  int pid_count = 0;
+  pid_t *pids = NULL;
+  int count = 0;
+  int size = 0;
 
   FCGX_PutS ("[", request->out);
 
   if (group_exists (controllers, path))
     {
       const char *first_controller;
-      char *other_controllers;
-      size_t l = strlen (controllers) + 1;
-      char cntlrs[l];
-      memcpy (cntlrs, controllers, l);
-      first_controller = strtok_r (cntlrs, ",", &other_controllers);
-      rc = cgroup_get_task_begin (path, first_controller, &handle, &pid);
-      debug ("cgroup_get_task_begin() returned %d", rc);
-
-      while (0 == rc)
+      char *other_controllers = NULL;
+      char *cntlrs = arena_strdup (request_arena, controllers);
+      first_controller =
+        (NULL != cntlrs) ? strtok_r (cntlrs, ",", &other_controllers) : NULL;
+      char *mountpoint = NULL;
+      struct dircache_entry *dir = NULL;
+      enum timing_phase phase = timing_enter (TIMING_BACKEND);
+      if ((NULL != first_controller)
+          && (0 == cgroup_get_subsys_mount_point (first_controller,
+                                                  &mountpoint)))
+        dir = dircache_get (mountpoint, path);
+      free (mountpoint);
+
+      // One pid per line
+      char *tasks = (NULL == dir) ? NULL :
+        read_file (dircache_fd (dir), "tasks");
+      if (NULL != dir)
+        dircache_put (dir);
+      char *line_tail = NULL;
+      for (char *line = (NULL == tasks) ? NULL :
+           strtok_r (tasks, "\n", &line_tail); NULL != line;
+           line = strtok_r (NULL, "\n", &line_tail))
         {
-          if ((NULL == other_controllers)
+          pid_t pid = (pid_t) strtol (line, NULL, 10);
+          // strtok_r() leaves "" after the last controller
+          if ((NULL == other_controllers) || ('\0' == *other_controllers)
               || group_has_pid (other_controllers, path, pid))
             {
-              if (pid_count > 0)
-                FCGX_PutS (", ", request->out);
-              FCGX_FPrintF (request->out, "%d", pid);
-              pid_count++;
+              // Threads of a process become the process
+              if (processes)
+                pid = proc_tgid (pid);
+              if ((pid > 0) && (count == size))
+                {
+                  size = (0 == size) ? 256 : 2 * size;
+                  pid_t *p = (pid_t *) arena_alloc (request_arena,
+                                                    size * sizeof (pid_t));
+                  if (NULL == p)
+                    {
+                      debug ("out of memory");
+                      break;
+                    }
+                  if (count > 0)
+                    memcpy (p, pids, count * sizeof (pid_t));
+                  pids = p;
+                }
+              if (pid > 0)
+                pids[count++] = pid;
             }
-          rc = cgroup_get_task_next (&handle, &pid);
         }
-      debug ("exit from loop with %d", rc);
-
-      cgroup_get_task_end (&handle);
+      timing_enter (phase);
     }
   else
     {
       debug ("group `%s:%s' does not exist", controllers, path);
     }
 
+  if (processes && (count > 1))
+    {
+      qsort (pids, count, sizeof (pid_t), compare_pids);
+      int unique = 1;
+      for (int i = 1; i < count; i++)
+        if (pids[i] != pids[unique - 1])
+          pids[unique++] = pids[i];
+      count = unique;
+    }
+  print_tasks (request, pids, count, fields, processes);
+
   FCGX_PutS ("]", request->out);
 }
 
 
+// Hierarchies to attach tasks, create or delete groups in
+struct hierarchy_fd
+{
+  struct hierarchy_fd *next;
+  const char *controller;       // first one, for error messages
+  const char *mountpoint;
+  struct dircache_entry *dir;   // the mount point
+  int fd;
+};
+
+
+static void
+close_hierarchies (struct hierarchy_fd *hierarchies)
+{
+  for (struct hierarchy_fd * h = hierarchies; NULL != h; h = h->next)
+    if (NULL != h->dir)
+      dircache_put (h->dir);
+}
+
+
+// Opens the mount point of every hierarchy of the controllers once.
+// All named controllers must be mounted, "*" is any.
+static struct hierarchy_fd *
+open_hierarchies (const char *controllers, const char **error)
+{
+  int rc;
+  void *handle = NULL;
+  struct cgroup_mount_point controller;
+  struct hierarchy_fd *hierarchies = NULL;
+  int found = 0;
+
+  *error = NULL;
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
+  rc = cgroup_get_controller_begin (&handle, &controller);
+  while ((0 == rc) && (NULL == *error))
+    {
+      if (controller_is_in_list (controllers, controller.name))
+        {
+          found++;
+          struct hierarchy_fd *h = hierarchies;
+          while ((NULL != h) && (0 != strcmp (h->mountpoint, controller.path)))
+            h = h->next;
+          if (NULL == h)
+            {
+              h = (struct hierarchy_fd *)
+                arena_alloc (request_arena, sizeof (struct hierarchy_fd));
+              if (NULL != h)
+                {
+                  h->controller = arena_strdup (request_arena, controller.name);
+                  h->mountpoint = arena_strdup (request_arena, controller.path);
+                  h->dir = NULL;
+                  h->fd = -1;
+                }
+              if ((NULL == h) || (NULL == h->controller)
+                  || (NULL == h->mountpoint))
+                *error = "Out of memory";
+              else
+                {
+                  h->next = hierarchies;
+                  hierarchies = h;
+                  h->dir = dircache_get (h->mountpoint, "/");
+                  if (NULL == h->dir)
+                    *error = strerror (errno);
+                  else
+                    h->fd = dircache_fd (h->dir);
+                }
+            }
+        }
+      rc = cgroup_get_controller_next (&handle, &controller);
+    }
+  cgroup_get_controller_end (&handle);
+  timing_enter (phase);
+
+  bool any = ('\0' == controllers[0]) || ('*' == controllers[0]);
+  if ((NULL == *error) && ((NULL == hierarchies)
+                           || (!any
+                               && (found < count_controllers (controllers)))))
+    *error = "Unknown controller";
+
+  if (NULL != *error)
+    {
+      close_hierarchies (hierarchies);
+      return NULL;
+    }
+  return hierarchies;
+}
+
+
+// "/base" and "a/b" => "base/a/b", relative to the mount points.
+// NULL for the root group and for "." or ".." in the path.
+static char *
+group_relative_path (const char *base, const char *name)
+{
+  size_t base_len = strlen (base);
+  char *path = (char *) arena_alloc (request_arena,
+                                     base_len + strlen (name) + 2);
+  if (NULL == path)
+    return NULL;
+
+  sprintf (path, "%s/%s", base, name);
+  char *rel = path;
+  while ('/' == *rel)
+    rel++;
+  trim_trailing_slashes (rel);
+  if (('\0' == *rel) || ('/' == *rel))
+    return NULL;
+
+  for (const char *c = rel; '\0' != *c;)
+    {
+      size_t len = strcspn (c, "/");
+      if (((1 == len) && ('.' == c[0]))
+          || ((2 == len) && ('.' == c[0]) && ('.' == c[1])))
+        return NULL;
+      c += len;
+      while ('/' == *c)
+        c++;
+    }
+  return rel;
+}
+
+
+// The pid goes to the tasks file of the group in every hierarchy
 static void
 fcgi_cgroups_attach_task (FCGX_Request * request, const char *controllers,
                           const char *path, const char *pid_s)
 {
-  char *p;
-  pid_t pid = strtoul (pid_s, &p, 10);
+  char *p = "";
+  pid_t pid = (NULL == pid_s) ? 0 : strtoul (pid_s, &p, 10);
 
   if ((pid <= 0) || ('\0' != *p))
     {
       debug ("invalid pid: %s", pid_s);
-      FCGX_FPrintF (request->out, "{error: \"Invalid pid\"}");
+      report_error (request, "Invalid pid");
       return;
     }
 
-  size_t controllers_len = strlen (controllers) + 1;
-  char controllers_copy[controllers_len];
-  memcpy (controllers_copy, controllers, controllers_len);
+  const char *error;
+  struct hierarchy_fd *hierarchies = open_hierarchies (controllers, &error);
+  if (NULL == hierarchies)
+    {
+      report_error (request, "%s", error);
+      return;
+    }
 
-  size_t number_of_controllers = count_controllers (controllers);
-  const char *controllers_list[number_of_controllers + 1];      // + sentinel
-  memset (controllers_list, 0, sizeof (controllers_list));
+  char pid_str[sizeof ("2147483647")];
+  int pid_len = snprintf (pid_str, sizeof (pid_str), "%d", pid);
+  const char *failed = NULL;
+  int rc = 0;
 
-  char *tail = NULL;
-  int controller_index = 0;
-  char *next_controller = strtok_r (controllers_copy, ",", &tail);
-  do
+  enum timing_phase phase = timing_enter (TIMING_BACKEND);
+  for (struct hierarchy_fd * h = hierarchies;
+       (NULL != h) && (0 == rc); h = h->next)
     {
-      debug ("controller[%d] = %s", controller_index, next_controller);
-      controllers_list[controller_index] = next_controller;
-      next_controller = strtok_r (NULL, ",", &tail);
-      controller_index++;
+      struct dircache_entry *dir = dircache_get (h->mountpoint, path);
+      int fd = (NULL == dir) ? -1 :
+        openat (dircache_fd (dir), "tasks", O_WRONLY | O_CLOEXEC);
+      ssize_t written = (fd < 0) ? -1 : write (fd, pid_str, pid_len);
+      if (written != pid_len)
+        {
+          // A short write leaves errno as it was
+          rc = (written < 0) ? errno : EIO;
+          failed = h->controller;
+        }
+      if (fd >= 0)
+        close (fd);
+      if (NULL != dir)
+        dircache_put (dir);
     }
-  while (NULL != next_controller);
+  timing_enter (phase);
+  close_hierarchies (hierarchies);
 
-  int rc = cgroup_change_cgroup_path (path, pid, controllers_list);
   if (0 != rc)
     {
-      debug ("cgroup_change_cgroup_path() returned %d (%s)", rc,
-             cgroup_strerror (rc));
-      FCGX_FPrintF (request->out, "{error: \"%s\"}", cgroup_strerror (rc));
+      debug ("attaching %d to `%s' failed: %s", pid, path, strerror (rc));
+      report_error (request, "%s: %s", failed, strerror (rc));
     }
   else
-    FCGX_FPrintF (request->out, "{}");
+    {
+      changes_notify ();
+      FCGX_FPrintF (request->out, "{}");
+    }
 }
 
 
+#define PROVISION_DELETE 1
+#define PROVISION_PARENTS 2
+#define PROVISION_RECURSIVE 4
+#define PROVISION_MIGRATE 8
+
+// Creates or deletes the groups of the comma-separated list
+// (relative to the path), or the path itself without a list.
+// Every group is done in all hierarchies before the next one.
+static void
+fcgi_cgroups_provision (FCGX_Request * request, const char *controllers,
+                        const char *path, const char *names, int flags)
+{
+  const char *error;
+  struct hierarchy_fd *hierarchies = open_hierarchies (controllers, &error);
+  if (NULL == hierarchies)
+    {
+      report_error (request, "%s", error);
+      return;
+    }
+
+  char *list = arena_strdup (request_arena, (NULL == names) ? "" : names);
+  if (NULL == list)
+    {
+      close_hierarchies (hierarchies);
+      report_error (request, "Out of memory");
+      return;
+    }
+
+  bool changed = false;
+  int count = 0;
+  char *tail = NULL;
+  char *name = strtok_r (list, ",", &tail);
+  FCGX_PutS ("[", request->out);
+  do
+    {
+      char *rel = group_relative_path (path, (NULL == name) ? "" : name);
+      const char *failed = NULL;
+      struct hierarchy_fd *stop = NULL;
+      int rc = 0;
+
+      if (NULL == rel)
+        {
+          rc = EINVAL;
+          failed = "Invalid group";
+        }
+      enum timing_phase phase = timing_enter (TIMING_BACKEND);
+      for (struct hierarchy_fd * h = hierarchies;
+           (NULL != h) && (0 == rc); h = h->next)
+        {
+          if (flags & PROVISION_DELETE)
+            {
+              rc = group_rmdir (h->fd, rel, flags & PROVISION_RECURSIVE,
+                                flags & PROVISION_MIGRATE);
+              // Some subgroups may be gone even on failure
+              dircache_forget (h->mountpoint, rel);
+            }
+          else
+            rc = group_mkdir (h->fd, rel, flags & PROVISION_PARENTS);
+          if (0 != rc)
+            {
+              failed = h->controller;
+              stop = h;
+            }
+          else
+            changed = true;
+        }
+      timing_enter (phase);
+
+      if (count > 0)
+        FCGX_PutS (",\n ", request->out);
+      count++;
+      if (NULL == rel)
+        FCGX_FPrintF (request->out, "{group: \"%s\", status: \"error\", "
+                      "error: \"%s\"}", (NULL == name) ? path : name, failed);
+      else if (0 != rc)
+        {
+          // Hierarchies before the failed one are not rolled back
+          FCGX_FPrintF (request->out, "{group: \"/%s\", status: \"error\", "
+                        "error: \"%s: %s\", done: [", rel, failed,
+                        strerror (rc));
+          for (struct hierarchy_fd * h = hierarchies; h != stop; h = h->next)
+            FCGX_FPrintF (request->out, "%s\"%s\"",
+                          (h == hierarchies) ? "" : ", ", h->controller);
+          FCGX_PutS ("]}", request->out);
+        }
+      else
+        FCGX_FPrintF (request->out, "{group: \"/%s\", status: \"ok\"}",
+                      rel);
+
+      name = strtok_r (NULL, ",", &tail);
+    }
+  while (NULL != name);
+  FCGX_PutS ("]", request->out);
+
+  close_hierarchies (hierarchies);
+  if (changed)
+    changes_notify ();
+}
+
+
+static void
+fcgi_cgroups_history (FCGX_Request * request, const char *controllers,
+                      const char *path, const char *seconds_s)
+{
+  char *p = "";
+  long seconds = (NULL == seconds_s) ? 0 : strtol (seconds_s, &p, 10);
+
+  if (!history_running ())
+    report_error (request, "History is not collected");
+  else if ((seconds <= 0) || (seconds > INT_MAX) || ('\0' != *p))
+    report_error (request, "Invalid number of seconds");
+  else if (0 != history_print (request->out, controllers, path, seconds))
+    report_error (request, "Out of memory");
+}
+
+
+static void
+fcgi_cgroups_since (FCGX_Request * request, const char *controllers,
+                    const char *path, const char *generation_s)
+{
+  char *p = "";
+  unsigned long since =
+    (NULL == generation_s) ? 0 : strtoul (generation_s, &p, 10);
+
+  if (!changes_running ())
+    report_error (request, "Changes are not tracked");
+  else if ((NULL == generation_s) || ('\0' != *p))
+    report_error (request, "Invalid generation");
+  else if (0 != changes_print (request->out, controllers, path, since))
+    report_error (request, "Out of memory");
+}
+
+
+struct field_name
+{
+  const char *name;
+  int flag;
+};
+
+
+// Comma-separated names, each exactly one of the known ones
+static bool
+parse_field_list (const char *value, const struct field_name *names,
+                  int *fields)
+{
+  *fields = 0;
+  do
+    {
+      size_t len = strcspn (value, ",");
+      const struct field_name *f = names;
+      while ((NULL != f->name)
+             && ((len != strlen (f->name))
+                 || (0 != strncmp (f->name, value, len))))
+        f++;
+      if (NULL == f->name)      // empty ones too
+        return false;
+      *fields |= f->flag;
+      value += len;
+    }
+  while (',' == *value++);
+  return true;
+}
+
+
+static bool
+parse_fields (const char *value, int *fields)
+{
+  static const struct field_name names[] = {
+    {"controllers", FIELD_CONTROLLERS},
+    {"groups", FIELD_GROUPS},
+    {"count", FIELD_COUNT},
+    {NULL, 0}
+  };
+  return parse_field_list (value, names, fields);
+}
+
+
+static bool
+parse_task_fields (const char *value, int *fields)
+{
+  static const struct field_name names[] = {
+    {"comm", TASK_COMM},
+    {"state", TASK_STATE},
+    {"rss", TASK_RSS},
+    {"utime", TASK_UTIME},
+    {"threads", TASK_THREADS},
+    {NULL, 0}
+  };
+  return parse_field_list (value, names, fields);
+}
+
+
+// Query is the action with its argument and walk options
+// in any order, e. g. "list&depth=1&fields=groups"
 static void
 fcgi_cgroups_action (FCGX_Request * request, const char *controllers,
-                     const char *path, const char *action)
+                     const char *path, const char *query)
 {
-  size_t l = strlen (action) + 1;
+  char *q = arena_strdup (request_arena, query);
+  if (NULL == q)
+    {
+      debug ("out of memory");
+      report_error (request, "Out of memory");
+      return;
+    }
 
-  char act[l];
+  struct walk_filter filter = {
+    .depth = -1,
+    .fields = FIELD_CONTROLLERS | FIELD_GROUPS
+  };
+  const char *act = NULL;
+  const char *arg = NULL;
+  const char *fields = NULL;    // depend on the action
+  int task_fields = 0;
+  bool processes = false;
+  int provision = 0;
 
-  memcpy (act, action, l);
+  char *tail = NULL;
+  for (char *param = strtok_r (q, "&", &tail); NULL != param;
+       param = strtok_r (NULL, "&", &tail))
+    {
+      char *value = strchr (param, '=');
+      if (NULL != value)
+        {
+          *value = '\0';
+          value++;
+          uri_unescape (value);
+        }
+
+      debug ("parameter `%s', value `%s'", param, value);
+
+      if (0 == strcmp ("depth", param))
+        {
+          char *p;
+          filter.depth = (NULL == value) ? -1 : strtol (value, &p, 10);
+          if ((filter.depth < 0) || ('\0' != *p))
+            {
+              report_error (request, "Invalid depth");
+              return;
+            }
+        }
+      else if (0 == strcmp ("prefix", param))
+        {
+          // a group path, as the ones listed
+          if ((NULL == value) || ('/' != value[0]))
+            {
+              report_error (request, "Invalid prefix");
+              return;
+            }
+          filter.prefix = value;
+        }
+      else if (0 == strcmp ("name", param))
+        filter.name = value;
+      else if (0 == strcmp ("parents", param))
+        provision |= PROVISION_PARENTS;
+      else if (0 == strcmp ("recursive", param))
+        provision |= PROVISION_RECURSIVE;
+      else if (0 == strcmp ("migrate", param))
+        provision |= PROVISION_MIGRATE;
+      else if (0 == strcmp ("fields", param))
+        fields = (NULL == value) ? "" : value;
+      else if (0 == strcmp ("processes", param))
+        processes = true;
+      else if (NULL == act)
+        {
+          act = param;
+          arg = value;
+        }
+    }
+
+  if (NULL == act)
+    act = "list";
 
-  char *arg = strchr (act, '=');
-  if (NULL != arg)
+  bool list_tasks = (0 == strcmp ("list-tasks", act));
+  if ((NULL != fields) && !(list_tasks ?
+                            parse_task_fields (fields, &task_fields) :
+                            parse_fields (fields, &filter.fields)))
     {
-      *arg = '\0';
-      arg++;
+      report_error (request, "Unknown field");
+      return;
     }
 
   debug ("action `%s', argument `%s'", act, arg);
+  timing_enter (TIMING_SERIALIZE);
 
   if (0 == strcmp ("list", act))
-    fcgi_cgroups_list_hierarhies (request, controllers, path);
-  else if (0 == strcmp ("list-tasks", act))
-    fcgi_cgroups_list_tasks (request, controllers, path);
+    fcgi_cgroups_list_hierarhies (request, controllers, path, &filter);
+  else if (list_tasks)
+    fcgi_cgroups_list_tasks (request, controllers, path, task_fields,
+                             processes);
   else if (0 == strcmp ("attach-task", act))
     fcgi_cgroups_attach_task (request, controllers, path, arg);
+  else if (0 == strcmp ("create", act))
+    fcgi_cgroups_provision (request, controllers, path, arg, provision);
+  else if (0 == strcmp ("delete", act))
+    fcgi_cgroups_provision (request, controllers, path, arg,
+                            provision | PROVISION_DELETE);
+  else if (0 == strcmp ("history", act))
+    fcgi_cgroups_history (request, controllers, path, arg);
+  else if (0 == strcmp ("since", act))
+    fcgi_cgroups_since (request, controllers, path, arg);
 }
 
 
@@ -502,6 +1500,7 @@ fcgi_cgroups (FCGX_Request * request, char **uri_tail)
   char *path = NULL;
   char *action = NULL;
 
+  timing_enter (TIMING_PARSE);
   while ('/' == **uri_tail)
     (*uri_tail)++;
 
@@ -530,8 +1529,14 @@ fcgi_cgroups (FCGX_Request * request, char **uri_tail)
   debug ("controllers `%s', path `%s', action `%s'", controllers, path,
          action);
 
-  if ((NULL == action) || ('\0' == action[0]))
-    fcgi_cgroups_list_hierarhies (request, controllers, path);
-  else
-    fcgi_cgroups_action (request, controllers, path, action);
+  int rc = backend_acquire ();
+  if (0 != rc)
+    {
+      debug ("libcgroup is not available: %s", cgroup_strerror (rc));
+      report_error (request, "%s", cgroup_strerror (rc));
+      return;
+    }
+  fcgi_cgroups_action (request, controllers, path,
+                       (NULL == action) ? "" : action);
+  backend_release ();
 }
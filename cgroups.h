@@ -23,8 +23,13 @@ THE SOFTWARE.
 #ifndef _CGROUPS_H
 #define _CGROUPS_H
 
+#include <stdbool.h>
+
 #include <fcgiapp.h>
 
+extern int cgroups_walk_threshold;
+
 void fcgi_cgroups (FCGX_Request *, char **);
+bool controller_is_in_list (const char *, const char *);
 
 #endif // _CGROUPS_H
@@ -0,0 +1,260 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _CGROUPS_EXPORT_H
+#define _CGROUPS_EXPORT_H
+
+// Reader of the hierarchy snapshot published by `fcgi --export=file'.
+// The file is memory-mapped and read in place, no system calls
+// are made unless the daemon has replaced the file with a bigger one.
+//
+//   struct cgroups_export e;
+//   if (0 != cgroups_export_open (&e, "/run/fcgi-cgroups"))
+//     ...
+//   uint64_t seq;
+//   do
+//     {
+//       if (0 != cgroups_export_read_begin (&e, &seq))
+//         ... the daemon is stuck writing (EAGAIN), try later ...
+//       ... copy what is needed with the accessors below ...
+//     }
+//   while (cgroups_export_read_retry (&e, seq));
+//
+// Data read between begin and retry may be torn and must not be
+// trusted before retry returns false: the accessors never read
+// out of the mapping, but may return garbage.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CGROUPS_EXPORT_MAGIC 0x58454743u        // "CGEX"
+#define CGROUPS_EXPORT_VERSION 1
+
+// Times a reader finds the daemon writing before it gives up,
+// e. g. when the daemon was killed in the middle of a write
+#define CGROUPS_EXPORT_RETRIES 10000
+
+struct cgroups_export_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sequence;            // odd while the daemon writes
+  uint64_t generation;          // see ?since
+  uint64_t size;                // of the whole file
+  uint32_t stale;               // replaced with a new file, reopen
+  uint32_t hierarchies_count;
+  uint32_t groups_count;
+  uint32_t tasks_count;
+  uint64_t hierarchies_offset;  // from the beginning of the file
+  uint64_t groups_offset;
+  uint64_t tasks_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+};
+
+// Controllers mounted together, e. g. "cpu,cpuacct"
+struct cgroups_export_hierarchy
+{
+  uint32_t name;                // offset in strings
+  uint32_t first_group;
+  uint32_t groups_count;
+};
+
+// Groups are sorted by path within a hierarchy,
+// the root group "/" comes first
+struct cgroups_export_group
+{
+  uint32_t path;                // offset in strings
+  uint32_t hierarchy;
+  uint32_t first_task;
+  uint32_t tasks_count;
+};
+
+// Tasks are int32_t PIDs, sorted within a group
+
+struct cgroups_export
+{
+  int fd;
+  void *base;
+  size_t length;
+  const char *path;
+};
+
+
+static inline const struct cgroups_export_header *
+cgroups_export_header (const struct cgroups_export *e)
+{
+  return (const struct cgroups_export_header *) e->base;
+}
+
+
+static inline int
+cgroups_export_map (struct cgroups_export *e)
+{
+  struct stat st;
+  e->fd = open (e->path, O_RDONLY | O_CLOEXEC);
+  if (e->fd < 0)
+    return -1;
+  if ((0 != fstat (e->fd, &st))
+      || ((size_t) st.st_size < sizeof (struct cgroups_export_header)))
+    {
+      close (e->fd);
+      return -1;
+    }
+  e->length = st.st_size;
+  e->base = mmap (NULL, e->length, PROT_READ, MAP_SHARED, e->fd, 0);
+  if (MAP_FAILED == e->base)
+    {
+      close (e->fd);
+      return -1;
+    }
+  if ((CGROUPS_EXPORT_MAGIC != cgroups_export_header (e)->magic)
+      || (CGROUPS_EXPORT_VERSION != cgroups_export_header (e)->version))
+    {
+      munmap (e->base, e->length);
+      close (e->fd);
+      return -1;
+    }
+  return 0;
+}
+
+
+static inline int
+cgroups_export_open (struct cgroups_export *e, const char *path)
+{
+  memset (e, 0, sizeof (*e));
+  e->path = path;
+  return cgroups_export_map (e);
+}
+
+
+static inline void
+cgroups_export_close (struct cgroups_export *e)
+{
+  munmap (e->base, e->length);
+  close (e->fd);
+}
+
+
+static inline int
+cgroups_export_read_begin (struct cgroups_export *e, uint64_t *seq)
+{
+  for (int retries = 0; retries < CGROUPS_EXPORT_RETRIES; retries++)
+    {
+      const struct cgroups_export_header *h = cgroups_export_header (e);
+      *seq = __atomic_load_n (&h->sequence, __ATOMIC_ACQUIRE);
+      if (*seq & 1)
+        {
+          sched_yield ();
+          continue;
+        }
+      if (h->stale)
+        {
+          // the only system calls, when the daemon has
+          // outgrown the file; keep the old one if it fails
+          struct cgroups_export fresh = *e;
+          if (0 == cgroups_export_map (&fresh))
+            {
+              cgroups_export_close (e);
+              *e = fresh;
+              continue;
+            }
+        }
+      return 0;
+    }
+  errno = EAGAIN;
+  return -1;
+}
+
+
+static inline bool
+cgroups_export_read_retry (const struct cgroups_export *e, uint64_t seq)
+{
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return seq != __atomic_load_n (&cgroups_export_header (e)->sequence,
+                                 __ATOMIC_RELAXED);
+}
+
+
+// Accessors return NULL instead of reading past the mapping
+
+static inline const void *
+cgroups_export_at (const struct cgroups_export *e, uint64_t offset,
+                   uint64_t count, size_t size)
+{
+  if ((offset > e->length) || (count > (e->length - offset) / size))
+    return NULL;
+  return (const char *) e->base + offset;
+}
+
+
+static inline const struct cgroups_export_hierarchy *
+cgroups_export_hierarchies (const struct cgroups_export *e)
+{
+  const struct cgroups_export_header *h = cgroups_export_header (e);
+  return (const struct cgroups_export_hierarchy *)
+    cgroups_export_at (e, h->hierarchies_offset, h->hierarchies_count,
+                       sizeof (struct cgroups_export_hierarchy));
+}
+
+
+static inline const struct cgroups_export_group *
+cgroups_export_groups (const struct cgroups_export *e)
+{
+  const struct cgroups_export_header *h = cgroups_export_header (e);
+  return (const struct cgroups_export_group *)
+    cgroups_export_at (e, h->groups_offset, h->groups_count,
+                       sizeof (struct cgroups_export_group));
+}
+
+
+static inline const int32_t *
+cgroups_export_tasks (const struct cgroups_export *e)
+{
+  const struct cgroups_export_header *h = cgroups_export_header (e);
+  return (const int32_t *) cgroups_export_at (e, h->tasks_offset,
+                                              h->tasks_count,
+                                              sizeof (int32_t));
+}
+
+
+// NUL-terminated, unless torn
+static inline const char *
+cgroups_export_string (const struct cgroups_export *e, uint32_t offset)
+{
+  const struct cgroups_export_header *h = cgroups_export_header (e);
+  const char *strings = (const char *)
+    cgroups_export_at (e, h->strings_offset, h->strings_size, 1);
+  if ((NULL == strings) || (offset >= h->strings_size))
+    return NULL;
+  return strings + offset;
+}
+
+#endif // _CGROUPS_EXPORT_H
@@ -0,0 +1,642 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <fcgiapp.h>
+#include <libcgroup.h>
+
+#include "arena.h"
+#include "backend.h"
+#include "cgroups.h"
+#include "changes.h"
+#include "export.h"
+#include "debug.h"
+
+// Tunable parameters, see --track-interval and --track-changes:
+int changes_interval = 0;
+int changes_max = 4096;
+
+enum change_type
+{
+  GROUP_ADDED,
+  GROUP_REMOVED,
+  TASK_MOVED,
+  TASK_GONE
+};
+
+static const char *const change_names[] = {
+  "group-added",
+  "group-removed",
+  "task-moved",
+  "task-gone"
+};
+
+struct change
+{
+  struct change *next;          // while not in the log yet
+  unsigned long generation;
+  enum change_type type;
+  pid_t pid;
+  char *controllers;
+  char *group;
+  char data[];
+};
+
+// Everything is malloc'ed, the tracker thread has no arena
+struct snapshot
+{
+  char **strings;
+  size_t strings_count, strings_size;
+  struct group_entry *groups;
+  size_t groups_count, groups_size;
+  struct task_entry *tasks;
+  size_t tasks_count, tasks_size;
+};
+
+static pthread_mutex_t changes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changes_wakeup = PTHREAD_COND_INITIALIZER;
+static bool running = false;
+static bool notified = false;
+
+// Log is complete for clients at truncated or later
+static unsigned long generation = 0;
+static unsigned long truncated = 0;
+static struct change **change_log = NULL;       // ring of changes_max
+static size_t log_start = 0;
+static size_t log_count = 0;
+
+
+// Grows *array of *size elements to fit one more
+static bool
+grow (void *array, size_t count, size_t * size, size_t element_size)
+{
+  if (count < *size)
+    return true;
+
+  size_t new_size = (0 == *size) ? 64 : (*size * 2);
+  void *bigger = realloc (*(void **) array, new_size * element_size);
+  if (NULL == bigger)
+    return false;
+  *(void **) array = bigger;
+  *size = new_size;
+  return true;
+}
+
+
+static const char *
+snapshot_string (struct snapshot *snap, const char *str, size_t len)
+{
+  if (!grow (&snap->strings, snap->strings_count, &snap->strings_size,
+             sizeof (char *)))
+    return NULL;
+
+  char *copy = (char *) malloc (len + 1);
+  if (NULL == copy)
+    return NULL;
+  memcpy (copy, str, len);
+  copy[len] = '\0';
+  snap->strings[snap->strings_count++] = copy;
+  return copy;
+}
+
+
+static void
+snapshot_free (struct snapshot *snap)
+{
+  if (NULL == snap)
+    return;
+  for (size_t i = 0; i < snap->strings_count; i++)
+    free (snap->strings[i]);
+  free (snap->strings);
+  free (snap->groups);
+  free (snap->tasks);
+  free (snap);
+}
+
+
+static int
+compare_groups (const void *a, const void *b)
+{
+  const struct group_entry *x = (const struct group_entry *) a;
+  const struct group_entry *y = (const struct group_entry *) b;
+  int rc = strcmp (x->hierarchy, y->hierarchy);
+  return (0 != rc) ? rc : strcmp (x->path, y->path);
+}
+
+
+static int
+compare_tasks (const void *a, const void *b)
+{
+  const struct task_entry *x = (const struct task_entry *) a;
+  const struct task_entry *y = (const struct task_entry *) b;
+  int rc = strcmp (x->hierarchy, y->hierarchy);
+  if (0 != rc)
+    return rc;
+  return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+
+// Groups of one hierarchy and their tasks
+static bool
+snapshot_hierarchy (struct snapshot *snap, const char *hierarchy,
+                    const char *controller, const char *mountpoint)
+{
+  void *handle = NULL;
+  int base_level = 0;
+  struct cgroup_file_info info;
+  size_t mountpoint_len = strlen (mountpoint);
+
+  int rc = cgroup_walk_tree_begin (controller, "/", 0, &handle, &info,
+                                   &base_level);
+  while (0 == rc)
+    {
+      if (CGROUP_FILE_TYPE_DIR == info.type)
+        {
+          const char *rel_path = info.full_path + mountpoint_len;
+          while ('/' == *rel_path)
+            rel_path++;
+          size_t len = strlen (rel_path);
+          while ((len > 0) && ('/' == rel_path[len - 1]))
+            len--;
+
+          // rel_path has a slash before it
+          const char *path = snapshot_string (snap, rel_path - 1, len + 1);
+          if ((NULL == path)
+              || !grow (&snap->groups, snap->groups_count,
+                        &snap->groups_size, sizeof (struct group_entry)))
+            {
+              cgroup_walk_tree_end (&handle);
+              return false;
+            }
+          snap->groups[snap->groups_count].hierarchy = hierarchy;
+          snap->groups[snap->groups_count].path = path;
+          snap->groups_count++;
+
+          void *task_handle = NULL;
+          pid_t pid;
+          int task_rc =
+            cgroup_get_task_begin (path, controller, &task_handle, &pid);
+          while (0 == task_rc)
+            {
+              if (!grow (&snap->tasks, snap->tasks_count, &snap->tasks_size,
+                         sizeof (struct task_entry)))
+                break;
+              snap->tasks[snap->tasks_count].hierarchy = hierarchy;
+              snap->tasks[snap->tasks_count].pid = pid;
+              snap->tasks[snap->tasks_count].path = path;
+              snap->tasks_count++;
+              task_rc = cgroup_get_task_next (&task_handle, &pid);
+            }
+          cgroup_get_task_end (&task_handle);
+          if (ECGEOF != task_rc)
+            debug ("listing tasks of `%s' failed: %d", path, task_rc);
+        }
+      rc = cgroup_walk_tree_next (0, &handle, &info, base_level);
+    }
+  cgroup_walk_tree_end (&handle);
+  return true;
+}
+
+
+static struct snapshot *
+snapshot_take (void)
+{
+  struct snapshot *snap = (struct snapshot *) calloc (1, sizeof (*snap));
+  if (NULL == snap)
+    return NULL;
+
+  // Mount points with all their controllers, e. g. "cpu,cpuacct"
+  struct hierarchy
+  {
+    char mountpoint[FILENAME_MAX];
+    char controller[FILENAME_MAX];
+    char controllers[FILENAME_MAX];
+  } *hierarchies = NULL;
+  size_t count = 0, size = 0;
+  bool ok = true;
+
+  void *handle = NULL;
+  struct cgroup_mount_point controller;
+  int rc = cgroup_get_controller_begin (&handle, &controller);
+  while (ok && (0 == rc))
+    {
+      size_t i = 0;
+      while ((i < count)
+             && (0 != strcmp (hierarchies[i].mountpoint, controller.path)))
+        i++;
+      if (i == count)
+        {
+          ok = grow (&hierarchies, count, &size, sizeof (*hierarchies));
+          if (ok)
+            {
+              snprintf (hierarchies[i].mountpoint, FILENAME_MAX, "%s",
+                        controller.path);
+              snprintf (hierarchies[i].controller, FILENAME_MAX, "%s",
+                        controller.name);
+              snprintf (hierarchies[i].controllers, FILENAME_MAX, "%s",
+                        controller.name);
+              count++;
+            }
+        }
+      else
+        {
+          size_t len = strlen (hierarchies[i].controllers);
+          snprintf (hierarchies[i].controllers + len, FILENAME_MAX - len,
+                    ",%s", controller.name);
+        }
+      rc = cgroup_get_controller_next (&handle, &controller);
+    }
+  cgroup_get_controller_end (&handle);
+
+  for (size_t i = 0; ok && (i < count); i++)
+    {
+      const char *name = snapshot_string (snap, hierarchies[i].controllers,
+                                          strlen (hierarchies[i].controllers));
+      ok = (NULL != name)
+        && snapshot_hierarchy (snap, name, hierarchies[i].controller,
+                               hierarchies[i].mountpoint);
+    }
+  free (hierarchies);
+
+  if (!ok)
+    {
+      debug ("out of memory");
+      snapshot_free (snap);
+      return NULL;
+    }
+
+  qsort (snap->groups, snap->groups_count, sizeof (struct group_entry),
+         compare_groups);
+  qsort (snap->tasks, snap->tasks_count, sizeof (struct task_entry),
+         compare_tasks);
+  debug ("%zu groups, %zu tasks", snap->groups_count, snap->tasks_count);
+  return snap;
+}
+
+
+static struct change *
+change_new (enum change_type type, const char *controllers,
+            const char *group, pid_t pid)
+{
+  size_t controllers_len = strlen (controllers) + 1;
+  size_t group_len = strlen (group) + 1;
+  struct change *c = (struct change *)
+    malloc (sizeof (struct change) + controllers_len + group_len);
+  if (NULL != c)
+    {
+      c->next = NULL;
+      c->type = type;
+      c->pid = pid;
+      c->controllers = c->data;
+      c->group = c->data + controllers_len;
+      memcpy (c->controllers, controllers, controllers_len);
+      memcpy (c->group, group, group_len);
+    }
+  return c;
+}
+
+
+// Both snapshots are sorted, walk them side by side.
+// Sets *incomplete if some changes could not be allocated.
+static struct change *
+snapshot_diff (const struct snapshot *old, const struct snapshot *new,
+               bool *incomplete)
+{
+  struct change *changes = NULL;
+  struct change **last = &changes;
+  struct change *c;
+
+  *incomplete = false;
+#define ADD_CHANGE(...) do { \
+    if (NULL != (c = change_new (__VA_ARGS__))) \
+      { \
+        *last = c; \
+        last = &c->next; \
+      } \
+    else \
+      *incomplete = true; \
+  } while (0)
+
+  size_t i = 0, j = 0;
+  while ((i < old->groups_count) || (j < new->groups_count))
+    {
+      int rc = (i == old->groups_count) ? 1 : (j == new->groups_count) ? -1
+        : compare_groups (&old->groups[i], &new->groups[j]);
+      if (rc < 0)
+        {
+          ADD_CHANGE (GROUP_REMOVED, old->groups[i].hierarchy,
+                      old->groups[i].path, 0);
+          i++;
+        }
+      else if (rc > 0)
+        {
+          ADD_CHANGE (GROUP_ADDED, new->groups[j].hierarchy,
+                      new->groups[j].path, 0);
+          j++;
+        }
+      else
+        i++, j++;
+    }
+
+  i = j = 0;
+  while ((i < old->tasks_count) || (j < new->tasks_count))
+    {
+      int rc = (i == old->tasks_count) ? 1 : (j == new->tasks_count) ? -1
+        : compare_tasks (&old->tasks[i], &new->tasks[j]);
+      if (rc < 0)
+        {
+          ADD_CHANGE (TASK_GONE, old->tasks[i].hierarchy,
+                      old->tasks[i].path, old->tasks[i].pid);
+          i++;
+        }
+      else if (rc > 0)
+        {
+          ADD_CHANGE (TASK_MOVED, new->tasks[j].hierarchy,
+                      new->tasks[j].path, new->tasks[j].pid);
+          j++;
+        }
+      else
+        {
+          if (0 != strcmp (old->tasks[i].path, new->tasks[j].path))
+            ADD_CHANGE (TASK_MOVED, new->tasks[j].hierarchy,
+                        new->tasks[j].path, new->tasks[j].pid);
+          i++, j++;
+        }
+    }
+#undef ADD_CHANGE
+
+  return changes;
+}
+
+
+// Under the lock
+static void
+log_append (struct change *changes)
+{
+  if (NULL == changes)
+    return;
+
+  generation++;
+  while (NULL != changes)
+    {
+      struct change *c = changes;
+      changes = c->next;
+      c->generation = generation;
+
+      if (log_count == (size_t) changes_max)
+        {
+          struct change *oldest = change_log[log_start];
+          truncated = oldest->generation;
+          free (oldest);
+          log_start = (log_start + 1) % changes_max;
+          log_count--;
+        }
+      change_log[(log_start + log_count) % changes_max] = c;
+      log_count++;
+    }
+  debug ("generation %lu, %zu changes logged", generation, log_count);
+}
+
+
+static void *
+tracker (void *arg)
+{
+  (void) arg;
+  struct snapshot *old = NULL;
+
+  while (1)
+    {
+      struct snapshot *snap = NULL;
+      if (0 == backend_acquire ())
+        {
+          snap = snapshot_take ();
+          backend_release ();
+        }
+      if (NULL != snap)
+        {
+          bool incomplete = false;
+          struct change *changes =
+            (NULL == old) ? NULL : snapshot_diff (old, snap, &incomplete);
+          bool publish = (NULL == old) || (NULL != changes) || incomplete;
+          pthread_mutex_lock (&changes_lock);
+          if (NULL == old)
+            {
+              // Generations of an earlier run are older
+              generation = truncated = (unsigned long) time (NULL) << 16;
+            }
+          log_append (changes);
+          if (incomplete)
+            {
+              // Clients before this generation resync
+              if (NULL == changes)
+                generation++;
+              truncated = generation;
+              debug ("changes lost, resync before generation %lu",
+                     generation);
+            }
+          unsigned long current = generation;
+          pthread_mutex_unlock (&changes_lock);
+
+          if (publish)
+            export_publish (current, snap->groups, snap->groups_count,
+                            snap->tasks, snap->tasks_count);
+          snapshot_free (old);
+          old = snap;
+        }
+
+      struct timespec deadline;
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += changes_interval;
+
+      pthread_mutex_lock (&changes_lock);
+      while (!notified
+             && (ETIMEDOUT != pthread_cond_timedwait (&changes_wakeup,
+                                                      &changes_lock,
+                                                      &deadline)));
+      notified = false;
+      pthread_mutex_unlock (&changes_lock);
+    }
+  return NULL;
+}
+
+
+int
+changes_start (void)
+{
+  if (0 == changes_interval)
+    return 0;
+
+  change_log = (struct change **) calloc (changes_max,
+                                          sizeof (struct change *));
+  if (NULL == change_log)
+    return -1;
+
+  debug ("tracking changes every %d s, %d records", changes_interval,
+         changes_max);
+
+  pthread_t thread;
+  int rc = pthread_create (&thread, NULL, tracker, NULL);
+  if (0 != rc)
+    {
+      errno = rc;
+      return -1;
+    }
+  pthread_detach (thread);
+  running = true;
+  return 0;
+}
+
+
+bool
+changes_running (void)
+{
+  return running;
+}
+
+
+// Changes made through the daemon show up without waiting
+void
+changes_notify (void)
+{
+  if (!running)
+    return;
+  pthread_mutex_lock (&changes_lock);
+  notified = true;
+  pthread_cond_signal (&changes_wakeup);
+  pthread_mutex_unlock (&changes_lock);
+}
+
+
+// Is group the path or under it?
+static bool
+path_matches (const char *path, const char *group)
+{
+  size_t len = strlen (path);
+  while ((len > 0) && ('/' == path[len - 1]))
+    len--;
+  return (0 == strncmp (path, group, len))
+    && (('\0' == group[len]) || ('/' == group[len]));
+}
+
+
+// Any controller of the hierarchy requested?
+static bool
+hierarchy_matches (const char *controllers, const char *hierarchy)
+{
+  char name[FILENAME_MAX];
+  while ('\0' != *hierarchy)
+    {
+      size_t len = strcspn (hierarchy, ",");
+      if (len < sizeof (name))
+        {
+          memcpy (name, hierarchy, len);
+          name[len] = '\0';
+          if (controller_is_in_list (controllers, name))
+            return true;
+        }
+      hierarchy += len;
+      if (',' == *hierarchy)
+        hierarchy++;
+    }
+  return false;
+}
+
+
+// Writes {generation: N, changes: [...]} with changes after since,
+// or {generation: N, resync: true} if some of them are lost.
+// Returns -1 if out of memory, nothing is written then.
+int
+changes_print (FCGX_Stream * out, const char *controllers, const char *path,
+               unsigned long since)
+{
+  pthread_mutex_lock (&changes_lock);
+
+  unsigned long current = generation;
+  bool resync = (since < truncated) || (since > generation);
+
+  // Copied out not to hold the lock while sending
+  struct change **copies = resync ? NULL : (struct change **)
+    arena_alloc (request_arena, sizeof (struct change *) * (log_count + 1));
+  size_t count = 0;
+
+  for (size_t i = 0; (NULL != copies) && (i < log_count); i++)
+    {
+      const struct change *c = change_log[(log_start + i) % changes_max];
+      if ((c->generation <= since)
+          || !hierarchy_matches (controllers, c->controllers)
+          || !path_matches (path, c->group))
+        continue;
+
+      size_t size = sizeof (struct change) + strlen (c->controllers) + 1
+        + strlen (c->group) + 1;
+      struct change *copy = (struct change *) arena_alloc (request_arena,
+                                                           size);
+      if (NULL == copy)
+        {
+          copies = NULL;
+          break;
+        }
+      memcpy (copy, c, size);
+      copy->controllers = copy->data + (c->controllers - c->data);
+      copy->group = copy->data + (c->group - c->data);
+      copies[count++] = copy;
+    }
+
+  pthread_mutex_unlock (&changes_lock);
+
+  if (!resync && (NULL == copies))
+    return -1;
+
+  if (resync)
+    {
+      FCGX_FPrintF (out, "{generation: %lu, resync: true}", current);
+      return 0;
+    }
+
+  FCGX_FPrintF (out, "{generation: %lu, changes: [", current);
+  for (size_t i = 0; i < count; i++)
+    {
+      const struct change *c = copies[i];
+      FCGX_FPrintF (out, "%s{generation: %lu, event: \"%s\", "
+                    "controllers: \"%s\", group: \"%s\"", (i > 0) ? ", " : "",
+                    c->generation, change_names[c->type], c->controllers,
+                    c->group);
+      if ((TASK_MOVED == c->type) || (TASK_GONE == c->type))
+        FCGX_FPrintF (out, ", pid: %d", c->pid);
+      FCGX_PutS ("}", out);
+    }
+  FCGX_PutS ("]}", out);
+  return 0;
+}
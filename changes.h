@@ -0,0 +1,58 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _CHANGES_H
+#define _CHANGES_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <fcgiapp.h>
+
+// Hierarchy generations: a background thread compares snapshots
+// of groups and their tasks and logs what has changed between them.
+
+// Snapshots are sorted by hierarchy, then path or pid,
+// tasks point to the path of their group
+struct group_entry
+{
+  const char *hierarchy;        // controllers, e. g. "cpu,cpuacct"
+  const char *path;
+};
+
+struct task_entry
+{
+  const char *hierarchy;
+  pid_t pid;
+  const char *path;
+};
+
+extern int changes_interval;    // seconds, 0 is off
+extern int changes_max;         // records in the log
+
+int changes_start (void);
+bool changes_running (void);
+void changes_notify (void);
+int changes_print (FCGX_Stream *, const char *, const char *, unsigned long);
+
+#endif // _CHANGES_H
@@ -0,0 +1,321 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <fcgiapp.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "arena.h"
+#include "compress.h"
+#include "debug.h"
+
+// Tunable parameter, see --compress-threshold:
+size_t compress_threshold = 4096;
+
+// Data is compressed in pieces of that size
+#define COMPRESS_BUFFER_SIZE (16 * 1024)
+
+// Contexts are reused by all requests of a worker thread
+#ifdef HAVE_ZLIB
+static __thread z_stream *gzip_context = NULL;
+#endif
+#ifdef HAVE_ZSTD
+static __thread ZSTD_CCtx *zstd_context = NULL;
+#endif
+
+
+static bool
+encoding_is_accepted (const char *accept_encoding, const char *name)
+{
+  size_t len = strlen (name);
+  const char *p = accept_encoding;
+
+  while ('\0' != *p)
+    {
+      while ((',' == *p) || isspace ((unsigned char) *p))
+        p++;
+      size_t token_len = strcspn (p, ",;");
+      while ((token_len > 0) && isspace ((unsigned char) p[token_len - 1]))
+        token_len--;
+
+      const char *params = p + strcspn (p, ",;");
+      const char *next = p + strcspn (p, ",");
+
+      if ((token_len == len) && (0 == strncasecmp (p, name, len)))
+        {
+          // "gzip;q=0" means "not gzip"
+          const char *q = strstr (params, "q=");
+          return (NULL == q) || (q >= next) || (strtod (q + 2, NULL) > 0);
+        }
+      p = next;
+    }
+  return false;
+}
+
+
+enum encoding
+compress_negotiate (const char *accept_encoding)
+{
+  if ((NULL == accept_encoding) || (0 == compress_threshold))
+    return ENCODING_IDENTITY;
+
+#ifdef HAVE_ZSTD
+  if (encoding_is_accepted (accept_encoding, "zstd"))
+    return ENCODING_ZSTD;
+#endif
+#ifdef HAVE_ZLIB
+  if (encoding_is_accepted (accept_encoding, "gzip"))
+    return ENCODING_GZIP;
+#endif
+  return ENCODING_IDENTITY;
+}
+
+
+static void
+compress_error (struct compress *z, int err)
+{
+  debug ("compression error: %d", err);
+  z->stream.isClosed = 1;
+  z->stream.FCGI_errno = err;
+}
+
+
+// Makes room in the response stream to compress into
+static bool
+out_reserve (FCGX_Stream * out)
+{
+  if (out->wrNext == out->stop)
+    {
+      if (out->isClosed)
+        return false;
+      out->emptyBuffProc (out, 0);
+    }
+  return !out->isClosed && (out->wrNext != out->stop);
+}
+
+
+static int
+compress_start (struct compress *z)
+{
+  const char *name = "identity";
+#ifdef HAVE_ZLIB
+  if (ENCODING_GZIP == z->encoding)
+    {
+      name = "gzip";
+      if (NULL == gzip_context)
+        {
+          z_stream *ctx = (z_stream *) calloc (1, sizeof (z_stream));
+          // 15 + 16: the largest window and gzip wrapper
+          if ((NULL == ctx) || (Z_OK != deflateInit2 (ctx, Z_DEFAULT_COMPRESSION,
+                                                      Z_DEFLATED, 15 + 16, 8,
+                                                      Z_DEFAULT_STRATEGY)))
+            {
+              free (ctx);
+              return -1;
+            }
+          gzip_context = ctx;
+        }
+      else if (Z_OK != deflateReset (gzip_context))
+        return -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if (ENCODING_ZSTD == z->encoding)
+    {
+      name = "zstd";
+      if (NULL == zstd_context)
+        zstd_context = ZSTD_createCCtx ();
+      if (NULL == zstd_context)
+        return -1;
+      ZSTD_CCtx_reset (zstd_context, ZSTD_reset_session_only);
+    }
+#endif
+
+  debug ("compressing with %s", name);
+  FCGX_FPrintF (z->out, "Content-Encoding: %s\r\n\r\n", name);
+  z->started = true;
+  return 0;
+}
+
+
+// Ends the headers without Content-Encoding, the buffer and
+// the rest of the response go out as they are
+static void
+compress_fallback (struct compress *z)
+{
+  FCGX_PutS ("\r\n", z->out);
+  z->encoding = ENCODING_IDENTITY;
+  z->started = true;
+}
+
+
+// Compresses the buffer straight into the response stream
+static int
+compress_buffer (struct compress *z, bool finish)
+{
+  size_t len = z->stream.wrNext - z->buffer;
+
+  if ((ENCODING_IDENTITY == z->encoding)
+      && (FCGX_PutStr ((const char *) z->buffer, len, z->out) != (int) len))
+    return -1;
+
+#ifdef HAVE_ZLIB
+  if (ENCODING_GZIP == z->encoding)
+    {
+      z_stream *ctx = gzip_context;
+      ctx->next_in = z->buffer;
+      ctx->avail_in = len;
+      int rc;
+      do
+        {
+          if (!out_reserve (z->out))
+            return -1;
+          ctx->next_out = z->out->wrNext;
+          ctx->avail_out = z->out->stop - z->out->wrNext;
+          rc = deflate (ctx, finish ? Z_FINISH : Z_NO_FLUSH);
+          z->out->wrNext = ctx->next_out;
+          if ((Z_OK != rc) && (Z_STREAM_END != rc) && (Z_BUF_ERROR != rc))
+            return -1;
+        }
+      while ((ctx->avail_in > 0) || (finish && (Z_STREAM_END != rc)));
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if (ENCODING_ZSTD == z->encoding)
+    {
+      ZSTD_inBuffer in = { z->buffer, len, 0 };
+      size_t remaining;
+      do
+        {
+          if (!out_reserve (z->out))
+            return -1;
+          ZSTD_outBuffer zout = { z->out->wrNext,
+            z->out->stop - z->out->wrNext, 0
+          };
+          remaining = ZSTD_compressStream2 (zstd_context, &zout, &in,
+                                            finish ? ZSTD_e_end :
+                                            ZSTD_e_continue);
+          z->out->wrNext += zout.pos;
+          if (ZSTD_isError (remaining))
+            return -1;
+        }
+      while ((in.pos < in.size) || (finish && (0 != remaining)));
+    }
+#endif
+
+  z->stream.wrNext = z->buffer;
+  return 0;
+}
+
+
+// Called when the buffer is full
+static void
+compress_empty_buffer (FCGX_Stream * stream, int do_close)
+{
+  struct compress *z = (struct compress *) stream->data;
+
+  if (do_close || stream->isClosed)
+    return;
+
+  if (!z->started && (0 != compress_start (z)))
+    {
+      debug ("cannot start compression, going uncompressed");
+      compress_fallback (z);
+    }
+
+  if (0 != compress_buffer (z, false))
+    compress_error (z, EIO);
+}
+
+
+void
+compress_begin (struct compress *z, FCGX_Request * request,
+                enum encoding encoding)
+{
+  memset (z, 0, sizeof (*z));
+  z->request = request;
+  z->out = request->out;
+  z->encoding = encoding;
+  z->stream.data = z;
+  z->stream.emptyBuffProc = compress_empty_buffer;
+
+  z->buffer_size = (compress_threshold > COMPRESS_BUFFER_SIZE) ?
+    compress_threshold : COMPRESS_BUFFER_SIZE;
+  z->buffer = (unsigned char *) arena_alloc (request_arena, z->buffer_size);
+  if (NULL == z->buffer)
+    {
+      // go uncompressed
+      FCGX_PutS ("\r\n", z->out);
+      z->encoding = ENCODING_IDENTITY;
+      return;
+    }
+
+  z->stream.wrNext = z->buffer;
+  z->stream.stop = z->buffer + z->buffer_size;
+  request->out = &z->stream;
+}
+
+
+int
+compress_end (struct compress *z)
+{
+  // compress_begin() went uncompressed
+  if (NULL == z->buffer)
+    return 0;
+
+  int rc = -1;
+  if (0 == z->stream.FCGI_errno)
+    {
+      size_t len = z->stream.wrNext - z->buffer;
+      if (!z->started && (len < compress_threshold))
+        {
+          debug ("%zu bytes, not compressing", len);
+          compress_fallback (z);
+        }
+      else if (!z->started && (0 != compress_start (z)))
+        {
+          debug ("cannot start compression, going uncompressed");
+          compress_fallback (z);
+        }
+      rc = compress_buffer (z, true);
+    }
+
+  z->stream.isClosed = 1;
+  z->request->out = z->out;
+  return rc;
+}
@@ -0,0 +1,62 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <fcgiapp.h>
+
+enum encoding
+{
+  ENCODING_IDENTITY = 0,
+  ENCODING_GZIP,
+  ENCODING_ZSTD
+};
+
+// Compressing filter between handlers and the response stream.
+// It holds the end of headers until compress_threshold bytes
+// are written, smaller responses go out as they are.
+struct compress
+{
+  FCGX_Stream stream;           // handlers write here via request->out
+  FCGX_Request *request;
+  FCGX_Stream *out;             // compressed data goes here
+  enum encoding encoding;
+  unsigned char *buffer;
+  size_t buffer_size;
+  bool started;                 // Content-Encoding sent
+};
+
+// Responses are held in memory up to the threshold
+#define COMPRESS_THRESHOLD_MAX (1024 * 1024)
+
+extern size_t compress_threshold;
+
+enum encoding compress_negotiate (const char *);
+void compress_begin (struct compress *, FCGX_Request *, enum encoding);
+int compress_end (struct compress *);
+
+#endif // _COMPRESS_H
@@ -0,0 +1,468 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "debug.h"
+
+// Watched are parents: a directory held open gets no IN_DELETE_SELF
+// until it is closed, but its parent gets IN_DELETE at once
+#define DIRCACHE_EVENTS (IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+// Tunable parameter, see --dir-cache:
+int dircache_size = 0;
+
+struct dircache_entry
+{
+  struct dircache_entry *hash_next;
+  struct dircache_entry *prev;  // least recently used list,
+  struct dircache_entry *next;  // most recent first
+  unsigned long hash;
+  int refs;                     // users, and one of the table
+  bool cached;
+  int fd;
+  int wd;                       // inotify watch of the parent or -1
+  const char *group;            // in key, "" is the mount point
+  char key[];                   // "mountpoint\0group"
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dircache_entry **buckets = NULL;
+static size_t number_of_buckets = 0;    // power of 2
+static struct dircache_entry *lru_first = NULL;
+static struct dircache_entry *lru_last = NULL;
+static int count = 0;
+static int inotify_fd = -1;
+
+
+// "/a/b/" => "a/b", no "." or ".." to get out of the mount point
+static const char *
+normalize_group (const char *group, size_t *len)
+{
+  while ('/' == *group)
+    group++;
+  *len = strlen (group);
+  while ((*len > 0) && ('/' == group[*len - 1]))
+    (*len)--;
+
+  for (size_t i = 0; i < *len;)
+    {
+      size_t l = strcspn (group + i, "/");
+      if (l > *len - i)
+        l = *len - i;
+      if (((1 == l) && ('.' == group[i]))
+          || ((2 == l) && ('.' == group[i]) && ('.' == group[i + 1])))
+        return NULL;
+      i += l;
+      while ((i < *len) && ('/' == group[i]))
+        i++;
+    }
+  return group;
+}
+
+
+static unsigned long
+hash_key (const char *mountpoint, const char *group, size_t len)
+{
+  unsigned long hash = 5381;
+  for (const char *c = mountpoint; '\0' != *c; c++)
+    hash = hash * 33 + (unsigned char) *c;
+  hash = hash * 33;
+  for (size_t i = 0; i < len; i++)
+    hash = hash * 33 + (unsigned char) group[i];
+  return hash;
+}
+
+
+static struct dircache_entry *
+find (const char *mountpoint, const char *group, size_t len,
+      unsigned long hash)
+{
+  if (NULL == buckets)
+    return NULL;
+  for (struct dircache_entry * e = buckets[hash & (number_of_buckets - 1)];
+       NULL != e; e = e->hash_next)
+    if ((e->hash == hash) && (0 == strcmp (e->key, mountpoint))
+        && (len == strlen (e->group)) && (0 == memcmp (e->group, group, len)))
+      return e;
+  return NULL;
+}
+
+
+static void
+unref (struct dircache_entry *e)
+{
+  if (0 == --e->refs)
+    {
+      close (e->fd);
+      free (e);
+    }
+}
+
+
+static void
+lru_unlink (struct dircache_entry *e)
+{
+  if (NULL != e->prev)
+    e->prev->next = e->next;
+  else
+    lru_first = e->next;
+  if (NULL != e->next)
+    e->next->prev = e->prev;
+  else
+    lru_last = e->prev;
+}
+
+
+static void
+lru_push (struct dircache_entry *e)
+{
+  e->prev = NULL;
+  e->next = lru_first;
+  if (NULL != lru_first)
+    lru_first->prev = e;
+  else
+    lru_last = e;
+  lru_first = e;
+}
+
+
+// Out of the table, closed when the last user is done
+static void
+evict (struct dircache_entry *e)
+{
+  struct dircache_entry **p = &buckets[e->hash & (number_of_buckets - 1)];
+  while (*p != e)
+    p = &(*p)->hash_next;
+  *p = e->hash_next;
+  lru_unlink (e);
+  e->cached = false;
+  count--;
+
+  // Siblings share the watch of their parent
+  bool shared = false;
+  for (struct dircache_entry * o = lru_first; (NULL != o) && !shared;
+       o = o->next)
+    shared = (o->wd == e->wd);
+  if ((e->wd >= 0) && !shared)
+    inotify_rm_watch (inotify_fd, e->wd);
+
+  unref (e);
+}
+
+
+// The group and all below it, the whole hierarchy for ""
+static void
+forget_locked (const char *mountpoint, const char *group, size_t len)
+{
+  struct dircache_entry *next;
+  for (struct dircache_entry * e = lru_first; NULL != e; e = next)
+    {
+      next = e->next;
+      if ((0 == strcmp (e->key, mountpoint))
+          && ((0 == len) || ((0 == strncmp (e->group, group, len))
+                             && (('\0' == e->group[len])
+                                 || ('/' == e->group[len])))))
+        evict (e);
+    }
+}
+
+
+static struct dircache_entry *
+entry_new (const char *mountpoint, const char *group, size_t len,
+           unsigned long hash, int fd)
+{
+  size_t mountpoint_size = strlen (mountpoint) + 1;
+  struct dircache_entry *e = (struct dircache_entry *)
+    malloc (sizeof (struct dircache_entry) + mountpoint_size + len + 1);
+  if (NULL == e)
+    return NULL;
+
+  memcpy (e->key, mountpoint, mountpoint_size);
+  memcpy (e->key + mountpoint_size, group, len);
+  e->key[mountpoint_size + len] = '\0';
+  e->group = e->key + mountpoint_size;
+  e->hash = hash;
+  e->refs = 1;
+  e->cached = false;
+  e->fd = fd;
+  e->wd = -1;
+  return e;
+}
+
+
+// Returns the directory of the group with a reference, or NULL and errno
+struct dircache_entry *
+dircache_get (const char *mountpoint, const char *group)
+{
+  size_t len;
+  group = normalize_group (group, &len);
+  if (NULL == group)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  unsigned long hash = hash_key (mountpoint, group, len);
+
+  pthread_mutex_lock (&lock);
+  struct dircache_entry *e = find (mountpoint, group, len, hash);
+  if (NULL != e)
+    {
+      lru_unlink (e);
+      lru_push (e);
+      e->refs++;
+    }
+  pthread_mutex_unlock (&lock);
+
+  if (NULL != e)
+    {
+      // Removed, but inotify has not told yet
+      struct stat st;
+      if (0 == fstatat (e->fd, "cgroup.procs", &st, 0))
+        return e;
+      debug ("cached `%s/%.*s' is gone", mountpoint, (int) len, group);
+      pthread_mutex_lock (&lock);
+      if (e->cached)
+        evict (e);
+      unref (e);
+      pthread_mutex_unlock (&lock);
+    }
+
+  int fd;
+  if (0 == len)
+    fd = open (mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  else
+    {
+      char *rel = strndup (group, len);
+      struct dircache_entry *root = (NULL == rel) ? NULL :
+        dircache_get (mountpoint, "");
+      fd = (NULL == root) ? -1 :
+        openat (root->fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      int saved_errno = errno;
+      if (NULL != root)
+        dircache_put (root);
+      free (rel);
+      errno = saved_errno;
+    }
+  if (fd < 0)
+    return NULL;
+
+  e = entry_new (mountpoint, group, len, hash, fd);
+  if (NULL == e)
+    {
+      close (fd);
+      errno = ENOMEM;
+      return NULL;
+    }
+  if (0 == dircache_size)
+    return e;
+
+  // Mount points go away with a reload of the backend
+  if ((inotify_fd >= 0) && (0 != len))
+    {
+      char proc_fd[sizeof ("/proc/self/fd/2147483647/..")];
+      snprintf (proc_fd, sizeof (proc_fd), "/proc/self/fd/%d/..", fd);
+      e->wd = inotify_add_watch (inotify_fd, proc_fd, DIRCACHE_EVENTS);
+    }
+
+  pthread_mutex_lock (&lock);
+  struct dircache_entry *other = find (mountpoint, group, len, hash);
+  if (NULL != other)
+    {
+      // Another thread was faster, the watch is the same
+      other->refs++;
+      pthread_mutex_unlock (&lock);
+      close (e->fd);
+      free (e);
+      return other;
+    }
+
+  if (NULL == buckets)
+    {
+      number_of_buckets = 16;
+      while (number_of_buckets < 2 * (size_t) dircache_size)
+        number_of_buckets *= 2;
+      buckets = (struct dircache_entry **)
+        calloc (number_of_buckets, sizeof (struct dircache_entry *));
+    }
+  if (NULL != buckets)
+    {
+      size_t b = hash & (number_of_buckets - 1);
+      e->hash_next = buckets[b];
+      buckets[b] = e;
+      lru_push (e);
+      e->cached = true;
+      e->refs++;
+      count++;
+      while (count > dircache_size)
+        evict (lru_last);
+    }
+  pthread_mutex_unlock (&lock);
+  return e;
+}
+
+
+int
+dircache_fd (const struct dircache_entry *e)
+{
+  return e->fd;
+}
+
+
+void
+dircache_put (struct dircache_entry *e)
+{
+  pthread_mutex_lock (&lock);
+  unref (e);
+  pthread_mutex_unlock (&lock);
+}
+
+
+void
+dircache_forget (const char *mountpoint, const char *group)
+{
+  size_t len;
+  group = normalize_group (group, &len);
+  if (NULL == group)
+    return;
+
+  pthread_mutex_lock (&lock);
+  forget_locked (mountpoint, group, len);
+  pthread_mutex_unlock (&lock);
+}
+
+
+void
+dircache_flush (void)
+{
+  pthread_mutex_lock (&lock);
+  while (NULL != lru_first)
+    evict (lru_first);
+  pthread_mutex_unlock (&lock);
+}
+
+
+static bool
+is_child (const struct dircache_entry *e, int wd, const char *name)
+{
+  if (e->wd != wd)
+    return false;
+  const char *slash = strrchr (e->group, '/');
+  return (0 == strcmp ((NULL == slash) ? e->group : slash + 1, name));
+}
+
+
+// Drops the directory that has gone from the watched one,
+// and everything below it
+static void
+forget_child (int wd, const char *name)
+{
+  pthread_mutex_lock (&lock);
+  while (1)
+    {
+      struct dircache_entry *e = lru_first;
+      while ((NULL != e) && !is_child (e, wd, name))
+        e = e->next;
+      if (NULL == e)
+        break;
+
+      debug ("`%s/%s' has gone away", e->key, e->group);
+      // forget_locked() may free it
+      e->refs++;
+      forget_locked (e->key, e->group, strlen (e->group));
+      unref (e);
+    }
+  pthread_mutex_unlock (&lock);
+}
+
+
+static void *
+watcher (void *arg)
+{
+  char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  while (1)
+    {
+      ssize_t got = read (inotify_fd, buf, sizeof (buf));
+      if (got < 0)
+        {
+          if (EINTR == errno)
+            continue;
+          debug ("read() of inotify failed: %s", strerror (errno));
+          break;
+        }
+
+      for (char *p = buf; p < buf + got;)
+        {
+          const struct inotify_event *ev = (const struct inotify_event *) p;
+          if (ev->mask & IN_Q_OVERFLOW)
+            dircache_flush ();
+          else if ((ev->mask & IN_ISDIR) && (ev->len > 0))
+            forget_child (ev->wd, ev->name);
+          p += sizeof (struct inotify_event) + ev->len;
+        }
+    }
+  return NULL;
+}
+
+
+int
+dircache_start (void)
+{
+  if (0 == dircache_size)
+    return 0;
+
+  inotify_fd = inotify_init1 (IN_CLOEXEC);
+  if (inotify_fd < 0)
+    {
+      // Still works, removals are found on use
+      debug ("inotify_init1() failed: %s", strerror (errno));
+      return 0;
+    }
+
+  pthread_t thread;
+  int rc = pthread_create (&thread, NULL, watcher, NULL);
+  if (0 != rc)
+    {
+      close (inotify_fd);
+      inotify_fd = -1;
+      errno = rc;
+      return -1;
+    }
+  pthread_detach (thread);
+  return 0;
+}
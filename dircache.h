@@ -0,0 +1,42 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+// Open directories of groups, least recently used ones closed first,
+// so a group is one openat() or fstatat() away from its cached fd
+// rather than a path walk from the mount point. Entries go away on
+// rmdir through us, or when inotify says the directory is gone.
+struct dircache_entry;
+
+extern int dircache_size;       // directories kept open, 0 is off
+
+int dircache_start (void);
+struct dircache_entry *dircache_get (const char *, const char *);
+int dircache_fd (const struct dircache_entry *);
+void dircache_put (struct dircache_entry *);
+void dircache_forget (const char *, const char *);
+void dircache_flush (void);
+
+#endif // _DIRCACHE_H
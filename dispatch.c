@@ -24,10 +24,21 @@ THE SOFTWARE.
 #include "config.h"
 #endif
 
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <fcgiapp.h>
 
+#include "admission.h"
+#include "aggregate.h"
+#include "batch.h"
+#include "compress.h"
+#include "dispatch.h"
+#include "output.h"
+#include "profile.h"
+#include "timing.h"
 #include "uri.h"
 #include "debug.h"
 
@@ -35,32 +46,43 @@ THE SOFTWARE.
 #include "cgroups.h"
 #endif
 
+__thread bool request_failed = false;
+
+// Writes {error: "..."} and marks the request as failed
 void
-dispatch (FCGX_Request * request)
+report_error (FCGX_Request * request, const char *format, ...)
 {
-  char *uri_tail;
-  char *uri = FCGX_GetParam ("REQUEST_URI", request->envp);
+  va_list ap;
 
-  debug ("request uri = `%s'", uri);
+  request_failed = true;
 
-  FCGX_PutS ("Content-type: application/json\r\n", request->out);
-  FCGX_PutS ("\r\n", request->out);
+  FCGX_PutS ("{error: \"", request->out);
+  va_start (ap, format);
+  FCGX_VFPrintF (request->out, format, ap);
+  va_end (ap);
+  FCGX_PutS ("\"}", request->out);
+}
 
-  if (strstr (uri, uri_prefix) != uri)
-    {
-      FCGX_FPrintF (request->out, "{error: \"Request must start with %s\"}",
-                    uri_prefix);
-      return;
-    }
-  else
-    uri += uri_prefix_len;
-  debug ("stripped uri = `%s'", uri);
 
+// uri is what follows the prefix, e. g. "/cgroups/cpu:/?list"
+void
+route (FCGX_Request * request, char *uri)
+{
+  char *uri_tail;
+
+  timing_enter (TIMING_ROUTE);
   const char *driver = strtok_r (uri, "/", &uri_tail);
   debug ("driver = `%s'", driver);
+  timing_enter (TIMING_SERIALIZE);
 
   if (NULL == driver)
     FCGX_PutS ("{}", request->out);
+  else if (0 == strcmp ("batch", driver))
+    fcgi_batch (request);
+  else if (0 == strcmp ("aggregate", driver))
+    fcgi_aggregate (request, (NULL == uri_tail) ? "" : uri_tail);
+  else if (0 == strcmp ("debug", driver))
+    fcgi_profile (request, (NULL == uri_tail) ? "" : uri_tail);
 #ifdef ENABLE_CGROUPS
   else if (0 == strcmp ("cgroups", driver))
     fcgi_cgroups (request, &uri_tail);
@@ -68,6 +90,103 @@ dispatch (FCGX_Request * request)
   else
     {
       debug ("unknown request: `%s'", driver);
-      FCGX_FPrintF (request->out, "{error: \"Unknown request: %s\"}", driver);
+      report_error (request, "Unknown request: %s", driver);
+    }
+}
+
+
+// Everything is JSON but folded stacks, which go to flamegraph.pl
+static const char *
+content_type (const char *uri)
+{
+  uri += strspn (uri, "/");
+  if (0 == strncmp ("debug/profile", uri, 13))
+    return "Content-type: text/plain\r\n";
+  return "Content-type: application/json\r\n";
+}
+
+
+// Ends the headers, possibly with the compression filter
+static void
+begin_body (FCGX_Request * request, struct compress *z,
+            enum encoding encoding)
+{
+  if (ENCODING_IDENTITY != encoding)
+    {
+      // the end of headers is up to the filter
+      FCGX_PutS ("Vary: Accept-Encoding\r\n", request->out);
+      compress_begin (z, request, encoding);
+    }
+  else
+    FCGX_PutS ("\r\n", request->out);
+}
+
+
+void
+dispatch (FCGX_Request * request)
+{
+  struct output out;
+  struct compress z;
+  struct output_buffer body;
+  struct admission admission;
+  char *uri = FCGX_GetParam ("REQUEST_URI", request->envp);
+  enum encoding encoding =
+    compress_negotiate (FCGX_GetParam ("HTTP_ACCEPT_ENCODING", request->envp));
+
+  // Timings are known at the end, the body waits for them
+  bool server_timing = (NULL != request_timing)
+    && (NULL != FCGX_GetParam ("HTTP_X_SERVER_TIMING", request->envp));
+
+  debug ("request uri = `%s'", uri);
+
+  request_failed = false;
+  output_begin (&out, request);
+  FCGX_Stream *headers = request->out;
+
+  bool has_prefix = (NULL != uri) && (strstr (uri, uri_prefix) == uri);
+  if (!admission_enter (&admission, request,
+                        has_prefix ? uri + uri_prefix_len : NULL))
+    {
+      // Shed at once, before any work
+      FCGX_FPrintF (request->out, "Status: %s\r\nRetry-After: %d\r\n",
+                    admission.status, admission.retry_after);
+      FCGX_PutS ("Content-type: application/json\r\n\r\n", request->out);
+      report_error (request, "%s", admission.reason);
+      output_end (&out);
+      return;
+    }
+
+  FCGX_PutS (content_type (has_prefix ? uri + uri_prefix_len : ""),
+             request->out);
+  if (server_timing)
+    {
+      output_buffer_init (&body);
+      request->out = &body.stream;
     }
+  else
+    begin_body (request, &z, encoding);
+
+  if (!has_prefix)
+    report_error (request, "Request must start with %s", uri_prefix);
+  else
+    {
+      uri += uri_prefix_len;
+      debug ("stripped uri = `%s'", uri);
+      route (request, uri);
+    }
+  admission_leave (&admission);
+
+  if (server_timing)
+    {
+      request->out = headers;
+      timing_enter (TIMING_SERIALIZE);
+      timing_print (request->out, request_timing);
+      begin_body (request, &z, encoding);
+      output_buffer_put (&body, request->out);
+      output_buffer_free (&body);
+    }
+
+  if (ENCODING_IDENTITY != encoding)
+    compress_end (&z);
+  output_end (&out);
 }
@@ -23,8 +23,17 @@ THE SOFTWARE.
 #ifndef _DISPATCH_H
 #define _DISPATCH_H
 
+#include <stdbool.h>
+
 #include <fcgiapp.h>
 
+// Set by report_error(), the FastCGI status is left alone
+extern __thread bool request_failed;
+
 void dispatch (FCGX_Request *);
+void route (FCGX_Request *, char *);
+
+void report_error (FCGX_Request *, const char *, ...)
+  __attribute__ ((format (printf, 2, 3)));
 
 #endif // _DISPATCH_H
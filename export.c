@@ -0,0 +1,339 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgroups_export.h"
+#include "export.h"
+#include "debug.h"
+
+// Tunable parameter, see --export:
+const char *export_path = NULL;
+
+#define EXPORT_MIN_SIZE (64 * 1024)
+#define EXPORT_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+// The file being published, only the tracker thread touches it
+static int export_fd = -1;
+static void *export_base = NULL;
+static size_t export_size = 0;
+
+
+static int
+compare_tasks_by_group (const void *a, const void *b)
+{
+  const struct task_entry *x = (const struct task_entry *) a;
+  const struct task_entry *y = (const struct task_entry *) b;
+  int rc = strcmp (x->hierarchy, y->hierarchy);
+  if (0 == rc)
+    rc = strcmp (x->path, y->path);
+  if (0 == rc)
+    rc = (x->pid > y->pid) - (x->pid < y->pid);
+  return rc;
+}
+
+
+// Lays the snapshot out as it goes to the file, returns its size
+static size_t
+export_build (char **image, unsigned long generation,
+              const struct group_entry *groups, size_t groups_count,
+              const struct task_entry *sorted_tasks, size_t tasks_count)
+{
+  size_t hierarchies_count = 0;
+  size_t strings_size = 0;
+  for (size_t i = 0; i < groups_count; i++)
+    {
+      if ((0 == i) || (0 != strcmp (groups[i - 1].hierarchy,
+                                    groups[i].hierarchy)))
+        {
+          hierarchies_count++;
+          strings_size += strlen (groups[i].hierarchy) + 1;
+        }
+      strings_size += strlen (groups[i].path) + 1;
+    }
+
+  struct cgroups_export_header header;
+  memset (&header, 0, sizeof (header));
+  header.magic = CGROUPS_EXPORT_MAGIC;
+  header.version = CGROUPS_EXPORT_VERSION;
+  header.generation = generation;
+  header.hierarchies_count = hierarchies_count;
+  header.groups_count = groups_count;
+  header.tasks_count = tasks_count;
+  header.hierarchies_offset = EXPORT_ALIGN (sizeof (header));
+  header.groups_offset = EXPORT_ALIGN (header.hierarchies_offset
+                                       + hierarchies_count *
+                                       sizeof (struct
+                                               cgroups_export_hierarchy));
+  header.tasks_offset =
+    EXPORT_ALIGN (header.groups_offset +
+                  groups_count * sizeof (struct cgroups_export_group));
+  header.strings_offset =
+    EXPORT_ALIGN (header.tasks_offset + tasks_count * sizeof (int32_t));
+  header.strings_size = strings_size;
+
+  size_t size = header.strings_offset + strings_size;
+  *image = (char *) calloc (1, size);
+  if (NULL == *image)
+    return 0;
+
+  struct cgroups_export_hierarchy *hierarchies =
+    (struct cgroups_export_hierarchy *) (*image + header.hierarchies_offset);
+  struct cgroups_export_group *out_groups =
+    (struct cgroups_export_group *) (*image + header.groups_offset);
+  int32_t *pids = (int32_t *) (*image + header.tasks_offset);
+  char *strings = *image + header.strings_offset;
+
+  size_t string = 0;
+  size_t hierarchy = 0;
+  size_t task = 0;
+  for (size_t i = 0; i < groups_count; i++)
+    {
+      if ((0 == i) || (0 != strcmp (groups[i - 1].hierarchy,
+                                    groups[i].hierarchy)))
+        {
+          if (0 != i)
+            hierarchy++;
+          hierarchies[hierarchy].name = string;
+          hierarchies[hierarchy].first_group = i;
+          strcpy (strings + string, groups[i].hierarchy);
+          string += strlen (groups[i].hierarchy) + 1;
+        }
+      hierarchies[hierarchy].groups_count++;
+
+      out_groups[i].path = string;
+      out_groups[i].hierarchy = hierarchy;
+      strcpy (strings + string, groups[i].path);
+      string += strlen (groups[i].path) + 1;
+
+      // tasks of groups gone while taking the snapshot are skipped
+      struct task_entry key = {.hierarchy = groups[i].hierarchy,
+        .path = groups[i].path,
+        .pid = -1
+      };
+      while ((task < tasks_count)
+             && (compare_tasks_by_group (&sorted_tasks[task], &key) < 0))
+        task++;
+      out_groups[i].first_task = task;
+      while ((task < tasks_count)
+             && (0 == strcmp (sorted_tasks[task].hierarchy, key.hierarchy))
+             && (0 == strcmp (sorted_tasks[task].path, key.path)))
+        {
+          pids[task] = sorted_tasks[task].pid;
+          out_groups[i].tasks_count++;
+          task++;
+        }
+    }
+
+  // the last byte of the file stays zero, so torn strings end there
+  header.size = size;
+  memcpy (*image, &header, sizeof (header));
+  return size;
+}
+
+
+static void *
+export_map (int fd, size_t size)
+{
+  if (0 != ftruncate (fd, size))
+    return NULL;
+  void *base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return (MAP_FAILED == base) ? NULL : base;
+}
+
+
+// Tells readers of the old file to map the new one
+static void
+export_mark_stale (struct cgroups_export_header *old)
+{
+  // odd if a writer died in the middle of it
+  uint64_t seq = old->sequence & ~(uint64_t) 1;
+  __atomic_store_n (&old->sequence, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  old->stale = 1;
+  __atomic_store_n (&old->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+// The file left by a previous run may still have readers
+static void
+export_mark_previous_stale (int fd)
+{
+  struct stat st;
+  if ((0 != fstat (fd, &st))
+      || ((size_t) st.st_size < sizeof (struct cgroups_export_header)))
+    return;
+
+  struct cgroups_export_header *old = (struct cgroups_export_header *)
+    mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == old)
+    return;
+  if ((CGROUPS_EXPORT_MAGIC == old->magic)
+      && (CGROUPS_EXPORT_VERSION == old->version))
+    {
+      debug ("marking the previous `%s' stale", export_path);
+      export_mark_stale (old);
+    }
+  munmap (old, st.st_size);
+}
+
+
+// Readers of the old file notice it is stale and map the new one
+static int
+export_replace (const char *image, size_t image_size)
+{
+  size_t size = EXPORT_MIN_SIZE;
+  while (size <= image_size * 2)
+    size *= 2;
+
+  char tmp_path[FILENAME_MAX];
+  snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", export_path);
+  int fd = open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  void *base = export_map (fd, size);
+  if (NULL == base)
+    {
+      close (fd);
+      unlink (tmp_path);
+      return -1;
+    }
+  memcpy (base, image, image_size);
+  ((struct cgroups_export_header *) base)->size = size;
+
+  if (0 != rename (tmp_path, export_path))
+    {
+      munmap (base, size);
+      close (fd);
+      unlink (tmp_path);
+      return -1;
+    }
+
+  if (NULL != export_base)
+    {
+      export_mark_stale ((struct cgroups_export_header *) export_base);
+      munmap (export_base, export_size);
+      close (export_fd);
+    }
+
+  debug ("new export file of %zu bytes", size);
+  export_fd = fd;
+  export_base = base;
+  export_size = size;
+  return 0;
+}
+
+
+// Rewrites the file in place under the seqlock
+static void
+export_write (const char *image, size_t image_size)
+{
+  struct cgroups_export_header *h =
+    (struct cgroups_export_header *) export_base;
+  uint64_t seq = h->sequence;
+
+  __atomic_store_n (&h->sequence, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  // everything past the sequence number, keeping the file size
+  size_t skip = offsetof (struct cgroups_export_header, generation);
+  memcpy ((char *) export_base + skip, image + skip, image_size - skip);
+  h->size = export_size;
+
+  __atomic_store_n (&h->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+void
+export_publish (unsigned long generation, const struct group_entry *groups,
+                size_t groups_count, const struct task_entry *tasks,
+                size_t tasks_count)
+{
+  if (NULL == export_path)
+    return;
+
+  struct task_entry *sorted_tasks = (struct task_entry *)
+    malloc (sizeof (struct task_entry) * (tasks_count + 1));
+  if (NULL == sorted_tasks)
+    return;
+  memcpy (sorted_tasks, tasks, sizeof (struct task_entry) * tasks_count);
+  qsort (sorted_tasks, tasks_count, sizeof (struct task_entry),
+         compare_tasks_by_group);
+
+  char *image = NULL;
+  size_t image_size = export_build (&image, generation, groups, groups_count,
+                                    sorted_tasks, tasks_count);
+  free (sorted_tasks);
+  if (0 == image_size)
+    return;
+
+  if (image_size >= export_size)
+    {
+      if (0 != export_replace (image, image_size))
+        debug ("failed to replace `%s': %s", export_path, strerror (errno));
+    }
+  else
+    export_write (image, image_size);
+
+  debug ("published generation %lu, %zu bytes", generation, image_size);
+  free (image);
+}
+
+
+// An empty snapshot for readers started before the first one
+int
+export_start (void)
+{
+  if (NULL == export_path)
+    return 0;
+
+  char *image = NULL;
+  size_t image_size = export_build (&image, 0, NULL, 0, NULL, 0);
+  if (0 == image_size)
+    return -1;
+  // Open before the new file takes its name
+  int previous = open (export_path, O_RDWR | O_CLOEXEC);
+  int rc = export_replace (image, image_size);
+  free (image);
+  if (previous >= 0)
+    {
+      if (0 == rc)
+        export_mark_previous_stale (previous);
+      close (previous);
+    }
+  return rc;
+}
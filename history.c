@@ -0,0 +1,582 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcgiapp.h>
+#include <libcgroup.h>
+
+#include "arena.h"
+#include "backend.h"
+#include "cgroups.h"
+#include "history.h"
+#include "debug.h"
+
+// Tunable parameters, see --history-interval, --history-samples
+// and --history-groups:
+int history_interval = 0;
+int history_samples = 360;
+int history_groups = 1024;
+
+// Rings are sized for that many bytes per sample on average,
+// samples with bigger deltas make the history shorter
+#define HISTORY_BYTES_PER_SAMPLE 4
+#define HISTORY_MIN_RING_SIZE 16       // a few largest deltas
+
+struct counter
+{
+  const char *controller;
+  const char *file;
+  const char *key;              // line of a keyed file, e. g. "Total 123"
+};
+
+static const struct counter counters[] = {
+  {"cpuacct", "cpuacct.usage", NULL},
+  {"memory", "memory.usage_in_bytes", NULL},
+  {"blkio", "blkio.throttle.io_service_bytes", "Total"}
+};
+
+#define NUMBER_OF_COUNTERS (sizeof (counters) / sizeof (counters[0]))
+
+// Samples of one counter of one group, the oldest value as is,
+// then zigzag varint deltas, one per tick, in a byte ring
+struct series
+{
+  struct series *next;          // in the hash bucket
+  int counter;
+  unsigned long first_tick;
+  unsigned long last_tick;
+  uint64_t first_value;
+  uint64_t last_value;
+  size_t head;                  // the oldest delta
+  size_t length;
+  unsigned char *ring;
+  char path[];
+};
+
+// Copied out under the lock, printed without it
+struct series_copy
+{
+  const char *path;
+  int counter;
+  unsigned long first_tick;
+  uint64_t first_value;
+  const unsigned char *deltas;
+  size_t length;
+};
+
+static pthread_rwlock_t history_lock = PTHREAD_RWLOCK_INITIALIZER;
+static bool running = false;
+static unsigned long tick = 0;  // the last sample taken
+static time_t *tick_times = NULL;       // tick % history_samples
+static struct series **buckets = NULL;
+static size_t number_of_buckets = 0;
+static int number_of_series[NUMBER_OF_COUNTERS];
+static size_t ring_size = 0;
+
+
+static uint64_t
+zigzag (int64_t n)
+{
+  return ((uint64_t) n << 1) ^ (uint64_t) (n >> 63);
+}
+
+
+static int64_t
+unzigzag (uint64_t n)
+{
+  return (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+}
+
+
+static size_t
+varint_encode (uint64_t n, unsigned char *buf)
+{
+  size_t len = 0;
+  while (n >= 0x80)
+    {
+      buf[len++] = (unsigned char) (n | 0x80);
+      n >>= 7;
+    }
+  buf[len++] = (unsigned char) n;
+  return len;
+}
+
+
+static uint64_t
+varint_decode (const unsigned char *buf, size_t *pos)
+{
+  uint64_t n = 0;
+  int shift = 0;
+  unsigned char byte;
+  do
+    {
+      byte = buf[(*pos)++];
+      n |= (uint64_t) (byte & 0x7f) << shift;
+      shift += 7;
+    }
+  while (byte & 0x80);
+  return n;
+}
+
+
+// Same, but wraps around the ring, *len is set to the bytes taken
+static uint64_t
+ring_varint (const struct series *s, size_t pos, size_t *len)
+{
+  uint64_t n = 0;
+  unsigned char byte;
+  *len = 0;
+  do
+    {
+      byte = s->ring[(pos + *len) % ring_size];
+      n |= (uint64_t) (byte & 0x7f) << (7 * *len);
+      (*len)++;
+    }
+  while (byte & 0x80);
+  return n;
+}
+
+
+static void
+series_drop_oldest (struct series *s)
+{
+  size_t len;
+  s->first_value += unzigzag (ring_varint (s, s->head, &len));
+  s->first_tick++;
+  s->head = (s->head + len) % ring_size;
+  s->length -= len;
+}
+
+
+static void
+series_append (struct series *s, unsigned long t, uint64_t value)
+{
+  if (t != s->last_tick + 1)
+    {
+      // new group or a gap, start over
+      s->first_tick = s->last_tick = t;
+      s->first_value = s->last_value = value;
+      s->head = s->length = 0;
+      return;
+    }
+
+  unsigned char buf[10];
+  size_t len = varint_encode (zigzag ((int64_t) (value - s->last_value)), buf);
+  while (ring_size - s->length < len)
+    series_drop_oldest (s);
+
+  size_t tail = (s->head + s->length) % ring_size;
+  for (size_t i = 0; i < len; i++)
+    s->ring[(tail + i) % ring_size] = buf[i];
+  s->length += len;
+  s->last_tick = t;
+  s->last_value = value;
+
+  // times of older ticks are overwritten
+  while (s->first_tick + history_samples <= t)
+    series_drop_oldest (s);
+}
+
+
+static size_t
+series_hash (int counter, const char *path)
+{
+  size_t h = 2166136261u ^ (size_t) counter;
+  for (const char *p = path; '\0' != *p; p++)
+    h = (h ^ (unsigned char) *p) * 16777619u;
+  return h & (number_of_buckets - 1);
+}
+
+
+// Under the write lock
+static struct series *
+series_get (int counter, const char *path)
+{
+  struct series **bucket = &buckets[series_hash (counter, path)];
+  for (struct series * s = *bucket; NULL != s; s = s->next)
+    if ((s->counter == counter) && (0 == strcmp (s->path, path)))
+      return s;
+
+  if (number_of_series[counter] >= history_groups)
+    {
+      debug ("too many groups, not tracking `%s' %s", path,
+             counters[counter].file);
+      return NULL;
+    }
+
+  size_t path_len = strlen (path) + 1;
+  struct series *s =
+    (struct series *) malloc (sizeof (struct series) + path_len + ring_size);
+  if (NULL == s)
+    return NULL;
+  memset (s, 0, sizeof (*s));
+  memcpy (s->path, path, path_len);
+  s->ring = (unsigned char *) s->path + path_len;
+  s->counter = counter;
+  s->next = *bucket;
+  *bucket = s;
+  number_of_series[counter]++;
+  return s;
+}
+
+
+// Under the write lock, forgets groups with nothing in the window
+static void
+series_expire (void)
+{
+  for (size_t i = 0; i < number_of_buckets; i++)
+    {
+      struct series **prev = &buckets[i];
+      while (NULL != *prev)
+        {
+          struct series *s = *prev;
+          if (s->last_tick + history_samples <= tick)
+            {
+              debug ("group `%s' %s is gone", s->path,
+                     counters[s->counter].file);
+              *prev = s->next;
+              number_of_series[s->counter]--;
+              free (s);
+            }
+          else
+            prev = &s->next;
+        }
+    }
+}
+
+
+// Only the sampler thread reads counters
+static bool
+read_counter (const char *path, const char *key, uint64_t * value)
+{
+  static char buf[64 * 1024];
+
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  size_t len = 0;
+  ssize_t rc;
+  while ((len < sizeof (buf) - 1)
+         && (((rc = read (fd, buf + len, sizeof (buf) - 1 - len)) > 0)
+             || ((rc < 0) && (EINTR == errno))))
+    if (rc > 0)
+      len += rc;
+  close (fd);
+  buf[len] = '\0';
+
+  const char *p = buf;
+  if (NULL != key)
+    {
+      size_t key_len = strlen (key);
+      while ((NULL != p) && !((0 == strncmp (p, key, key_len))
+                              && (' ' == p[key_len])))
+        {
+          p = strchr (p, '\n');
+          if (NULL != p)
+            p++;
+        }
+      if (NULL == p)
+        return false;
+      p += key_len;
+    }
+
+  char *end;
+  *value = strtoull (p, &end, 10);
+  return end != p;
+}
+
+
+static void
+sample_counter (int counter)
+{
+  const struct counter *c = &counters[counter];
+  char *mountpoint = NULL;
+  void *handle = NULL;
+  int base_level = 0;
+  struct cgroup_file_info info;
+
+  if (0 != cgroup_get_subsys_mount_point (c->controller, &mountpoint))
+    return;
+  size_t mountpoint_len = strlen (mountpoint);
+
+  int rc = cgroup_walk_tree_begin (c->controller, "/", 0, &handle, &info,
+                                   &base_level);
+  while (0 == rc)
+    {
+      if (CGROUP_FILE_TYPE_DIR == info.type)
+        {
+          char group[PATH_MAX];
+          char file[PATH_MAX];
+          const char *rel_path = info.full_path + mountpoint_len;
+          while ('/' == *rel_path)
+            rel_path++;
+          size_t len = strlen (rel_path);
+          while ((len > 0) && ('/' == rel_path[len - 1]))
+            len--;
+
+          uint64_t value;
+          if ((len < sizeof (group) - 1)
+              && (snprintf (file, sizeof (file), "%s/%s", info.full_path,
+                            c->file) < (int) sizeof (file))
+              && read_counter (file, c->key, &value))
+            {
+              group[0] = '/';
+              memcpy (group + 1, rel_path, len);
+              group[len + 1] = '\0';
+
+              pthread_rwlock_wrlock (&history_lock);
+              struct series *s = series_get (counter, group);
+              if (NULL != s)
+                series_append (s, tick, value);
+              pthread_rwlock_unlock (&history_lock);
+            }
+        }
+      rc = cgroup_walk_tree_next (0, &handle, &info, base_level);
+    }
+  cgroup_walk_tree_end (&handle);
+  free (mountpoint);
+}
+
+
+static void *
+sampler (void *arg)
+{
+  (void) arg;
+  struct timespec next;
+  clock_gettime (CLOCK_MONOTONIC, &next);
+
+  while (1)
+    {
+      pthread_rwlock_wrlock (&history_lock);
+      tick++;
+      tick_times[tick % history_samples] = time (NULL);
+      pthread_rwlock_unlock (&history_lock);
+
+      if (0 == backend_acquire ())
+        {
+          for (size_t c = 0; c < NUMBER_OF_COUNTERS; c++)
+            sample_counter (c);
+          backend_release ();
+        }
+
+      pthread_rwlock_wrlock (&history_lock);
+      series_expire ();
+      pthread_rwlock_unlock (&history_lock);
+
+      next.tv_sec += history_interval;
+      while (EINTR == clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                       &next, NULL));
+    }
+  return NULL;
+}
+
+
+int
+history_start (void)
+{
+  if (0 == history_interval)
+    return 0;
+
+  ring_size = (size_t) history_samples * HISTORY_BYTES_PER_SAMPLE;
+  if (ring_size < HISTORY_MIN_RING_SIZE)
+    ring_size = HISTORY_MIN_RING_SIZE;
+  number_of_buckets = 1;
+  while (number_of_buckets < (size_t) history_groups * NUMBER_OF_COUNTERS)
+    number_of_buckets <<= 1;
+
+  tick_times = (time_t *) calloc (history_samples, sizeof (time_t));
+  buckets = (struct series **) calloc (number_of_buckets,
+                                       sizeof (struct series *));
+  if ((NULL == tick_times) || (NULL == buckets))
+    return -1;
+
+  debug ("sampling every %d s, %d samples of %d groups", history_interval,
+         history_samples, history_groups);
+
+  pthread_t thread;
+  int rc = pthread_create (&thread, NULL, sampler, NULL);
+  if (0 != rc)
+    {
+      errno = rc;
+      return -1;
+    }
+  pthread_detach (thread);
+  running = true;
+  return 0;
+}
+
+
+bool
+history_running (void)
+{
+  return running;
+}
+
+
+// Is group the path or under it?
+static bool
+path_matches (const char *path, const char *group)
+{
+  size_t len = strlen (path);
+  while ((len > 0) && ('/' == path[len - 1]))
+    len--;
+  return (0 == strncmp (path, group, len))
+    && (('\0' == group[len]) || ('/' == group[len]));
+}
+
+
+static int
+compare_copies (const void *a, const void *b)
+{
+  const struct series_copy *x = (const struct series_copy *) a;
+  const struct series_copy *y = (const struct series_copy *) b;
+  int rc = strcmp (x->path, y->path);
+  return (0 != rc) ? rc : (x->counter - y->counter);
+}
+
+
+// Writes {interval: 10, times: [...], series: [{group: "/a",
+// counter: "cpuacct.usage", offset: 0, values: [...]}, ...]},
+// offset is where values start in times.
+// Returns -1 if out of memory, nothing is written then.
+int
+history_print (FCGX_Stream * out, const char *controllers, const char *path,
+               int seconds)
+{
+  pthread_rwlock_rdlock (&history_lock);
+
+  unsigned long last = tick;
+  unsigned long window = (seconds + history_interval - 1) / history_interval;
+  if (window < 1)
+    window = 1;
+  if (window > (unsigned long) history_samples)
+    window = history_samples;
+  if (window > last)
+    window = last;
+  unsigned long first = last - window + 1;
+
+  int count = 0;
+  for (size_t i = 0; i < number_of_buckets; i++)
+    for (const struct series * s = buckets[i]; NULL != s; s = s->next)
+      count++;
+
+  time_t *times = (time_t *) arena_alloc (request_arena,
+                                          sizeof (time_t) * (window + 1));
+  struct series_copy *copies = (struct series_copy *)
+    arena_alloc (request_arena, sizeof (struct series_copy) * (count + 1));
+  if ((NULL == times) || (NULL == copies))
+    {
+      pthread_rwlock_unlock (&history_lock);
+      return -1;
+    }
+
+  for (unsigned long t = first; t <= last; t++)
+    times[t - first] = tick_times[t % history_samples];
+
+  count = 0;
+  for (size_t i = 0; i < number_of_buckets; i++)
+    for (const struct series * s = buckets[i]; NULL != s; s = s->next)
+      {
+        if ((s->last_tick < first)
+            || !controller_is_in_list (controllers,
+                                       counters[s->counter].controller)
+            || !path_matches (path, s->path))
+          continue;
+
+        struct series_copy *c = &copies[count];
+        unsigned char *deltas =
+          (unsigned char *) arena_alloc (request_arena, s->length + 1);
+        c->path = arena_strdup (request_arena, s->path);
+        if ((NULL == deltas) || (NULL == c->path))
+          {
+            pthread_rwlock_unlock (&history_lock);
+            return -1;
+          }
+        size_t part = ring_size - s->head;
+        if (part > s->length)
+          part = s->length;
+        memcpy (deltas, s->ring + s->head, part);
+        memcpy (deltas + part, s->ring, s->length - part);
+
+        c->counter = s->counter;
+        c->first_tick = s->first_tick;
+        c->first_value = s->first_value;
+        c->deltas = deltas;
+        c->length = s->length;
+        count++;
+      }
+
+  pthread_rwlock_unlock (&history_lock);
+
+  qsort (copies, count, sizeof (struct series_copy), compare_copies);
+
+  FCGX_FPrintF (out, "{interval: %d, times: [", history_interval);
+  for (unsigned long t = 0; t < window; t++)
+    FCGX_FPrintF (out, (t > 0) ? ", %ld" : "%ld", (long) times[t]);
+  FCGX_PutS ("], series: [", out);
+
+  for (int i = 0; i < count; i++)
+    {
+      const struct series_copy *c = &copies[i];
+      unsigned long t = c->first_tick;
+      uint64_t value = c->first_value;
+      size_t pos = 0;
+
+      // skip what is older than the window
+      while ((t < first) && (pos < c->length))
+        {
+          value += unzigzag (varint_decode (c->deltas, &pos));
+          t++;
+        }
+
+      FCGX_FPrintF (out, "%s{group: \"%s\", counter: \"%s\", offset: %lu, "
+                    "values: [%lu", (i > 0) ? ", " : "", c->path,
+                    counters[c->counter].file, t - first,
+                    (unsigned long) value);
+      while (pos < c->length)
+        {
+          value += unzigzag (varint_decode (c->deltas, &pos));
+          FCGX_FPrintF (out, ", %lu", (unsigned long) value);
+        }
+      FCGX_PutS ("]}", out);
+    }
+
+  FCGX_PutS ("]}", out);
+  return 0;
+}
@@ -0,0 +1,42 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stdbool.h>
+
+#include <fcgiapp.h>
+
+// Accounting counters of all groups sampled by a background thread
+// into per-group rings of varint-encoded deltas.
+// Memory is bounded by history_groups * history_samples.
+extern int history_interval;    // seconds, 0 is off
+extern int history_samples;     // per counter and group
+extern int history_groups;      // groups tracked per counter
+
+int history_start (void);
+bool history_running (void);
+int history_print (FCGX_Stream *, const char *, const char *, int);
+
+#endif // _HISTORY_H
@@ -0,0 +1,939 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcgiapp.h>
+
+#include "arena.h"
+#include "dispatch.h"
+#include "listener.h"
+#include "output.h"
+#include "profile.h"
+#include "timing.h"
+#include "debug.h"
+
+// Request head: HTTP request line and headers, or SCGI netstring
+#define HEAD_MAX (16 * 1024)
+// Request body, batches are the only requests with one
+#define BODY_MAX (1024 * 1024)
+// Seconds a keep-alive connection may stay idle
+#define IDLE_TIMEOUT 5
+// Seconds to read a whole request, head and body
+#define REQUEST_TIMEOUT 10
+// Milliseconds a single recv() waits before the deadlines are checked
+#define READ_SLICE 200
+
+#define HTTP_ERROR(status) \
+  "HTTP/1.1 " status "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+struct listener *listeners = NULL;
+
+struct connection
+{
+  struct listener *listener;
+  int fd;
+  long deadline;                // ms, for the idle wait or the request
+  bool idle;                    // between keep-alive requests
+  char *buf;                    // HEAD_MAX bytes, kept across requests
+  size_t start;                 // unread bytes are buf[start..end)
+  size_t end;
+  char remote_addr[INET6_ADDRSTRLEN];
+};
+
+// CGI environment, built in the request arena
+struct environment
+{
+  char **envp;
+  int count;
+  int size;
+};
+
+
+int
+listener_add (enum listener_protocol protocol, const char *address)
+{
+  struct listener *l = (struct listener *) malloc (sizeof (struct listener));
+  if (NULL == l)
+    return -1;
+
+  l->next = NULL;
+  l->protocol = protocol;
+  l->address = address;
+  l->fd = -1;
+  l->accepting = 0;
+  l->yielding = 0;
+
+  // Keep the command line order
+  struct listener **tail = &listeners;
+  while (NULL != *tail)
+    tail = &(*tail)->next;
+  *tail = l;
+  return 0;
+}
+
+
+static int
+open_unix (const char *path, int backlog)
+{
+  struct sockaddr_un sa;
+  if (strlen (path) >= sizeof (sa.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  strcpy (sa.sun_path, path);
+
+  // Like FCGX_OpenSocket(), a stale socket file is replaced
+  unlink (path);
+  if ((0 != bind (fd, (struct sockaddr *) &sa, sizeof (sa)))
+      || (0 != listen (fd, backlog)))
+    {
+      int saved = errno;
+      close (fd);
+      errno = saved;
+      return -1;
+    }
+  return fd;
+}
+
+
+static int
+open_tcp (const char *address, int backlog)
+{
+  const char *colon = strrchr (address, ':');
+  size_t host_len = colon - address;
+  char host[host_len + 1];
+  struct addrinfo hints, *ai;
+
+  // "[::1]:8080" for IPv6 addresses
+  if ((host_len > 1) && ('[' == address[0]) && (']' == colon[-1]))
+    {
+      memcpy (host, address + 1, host_len - 2);
+      host[host_len - 2] = '\0';
+    }
+  else
+    {
+      memcpy (host, address, host_len);
+      host[host_len] = '\0';
+    }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int rc = getaddrinfo (('\0' == host[0]) ? NULL : host, colon + 1, &hints,
+                        &ai);
+  if (0 != rc)
+    {
+      debug ("getaddrinfo(`%s') failed: %s", address, gai_strerror (rc));
+      errno = EADDRNOTAVAIL;
+      return -1;
+    }
+
+  int fd = -1;
+  for (struct addrinfo * p = ai; NULL != p; p = p->ai_next)
+    {
+      fd = socket (p->ai_family, p->ai_socktype, p->ai_protocol);
+      if (fd < 0)
+        continue;
+
+      int on = 1;
+      setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+      if ((0 == bind (fd, p->ai_addr, p->ai_addrlen))
+          && (0 == listen (fd, backlog)))
+        break;
+
+      int saved = errno;
+      close (fd);
+      errno = saved;
+      fd = -1;
+    }
+  freeaddrinfo (ai);
+  return fd;
+}
+
+
+int
+listener_open (struct listener *l, int backlog)
+{
+  // Anything with a slash or without a port is a socket path
+  if ((NULL != strchr (l->address, '/'))
+      || (NULL == strchr (l->address, ':')))
+    l->fd = open_unix (l->address, backlog);
+  else
+    l->fd = open_tcp (l->address, backlog);
+
+  debug ("listening on `%s', fd = %d", l->address, l->fd);
+  return (l->fd < 0) ? -1 : 0;
+}
+
+
+static int
+send_all (int fd, struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  while (msg.msg_iovlen > 0)
+    {
+      ssize_t sent = sendmsg (fd, &msg, MSG_NOSIGNAL);
+      if (sent < 0)
+        {
+          if (EINTR == errno)
+            continue;
+          debug ("sendmsg() failed: %s", strerror (errno));
+          return -1;
+        }
+
+      while ((msg.msg_iovlen > 0) && ((size_t) sent >= msg.msg_iov->iov_len))
+        {
+          sent -= msg.msg_iov->iov_len;
+          ++msg.msg_iov;
+          --msg.msg_iovlen;
+        }
+      if (msg.msg_iovlen > 0)
+        {
+          msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+          msg.msg_iov->iov_len -= sent;
+        }
+    }
+  return 0;
+}
+
+
+static int
+send_string (int fd, const char *str)
+{
+  struct iovec iov = {.iov_base = (void *) str,.iov_len = strlen (str) };
+  return send_all (fd, &iov, 1);
+}
+
+
+static long
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+static void
+connection_set_deadline (struct connection *c, bool idle)
+{
+  c->idle = idle;
+  c->deadline = now_ms () + 1000L * (idle ? IDLE_TIMEOUT : REQUEST_TIMEOUT);
+}
+
+
+// Called when recv() comes back empty after READ_SLICE ms: gives up
+// at the deadline and, when idle, if new connections are waiting for
+// a thread, since a thread per connection must not be held by
+// keep-alive clients.
+static bool
+connection_expired (struct connection *c)
+{
+  struct listener *l = c->listener;
+
+  if (now_ms () >= c->deadline)
+    {
+      debug ("connection timed out");
+      return true;
+    }
+  if (!c->idle || (0 != __atomic_load_n (&l->accepting, __ATOMIC_ACQUIRE)))
+    return false;
+
+  struct pollfd pfd = {.fd = l->fd,.events = POLLIN };
+  if ((1 == poll (&pfd, 1, 0))
+      && (0 == __atomic_exchange_n (&l->yielding, 1, __ATOMIC_ACQ_REL)))
+    {
+      debug ("closing idle connection for a new one");
+      return true;
+    }
+  return false;
+}
+
+
+// Reads more data into the connection buffer.
+// Returns the number of bytes read, 0 on EOF and -1 on errors,
+// including timeouts and a full buffer.
+static ssize_t
+connection_read (struct connection *c)
+{
+  if (HEAD_MAX == c->end)
+    {
+      memmove (c->buf, c->buf + c->start, c->end - c->start);
+      c->end -= c->start;
+      c->start = 0;
+    }
+  if (HEAD_MAX == c->end)
+    return -1;
+
+  ssize_t got;
+  while (1)
+    {
+      got = recv (c->fd, c->buf + c->end, HEAD_MAX - c->end, 0);
+      if ((got < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+        {
+          if (connection_expired (c))
+            return -1;
+          continue;
+        }
+      if ((got < 0) && (EINTR == errno))
+        continue;
+      break;
+    }
+
+  if (got > 0)
+    c->end += got;
+  return got;
+}
+
+
+// Takes `length' bytes of the head out of the connection buffer
+static char *
+connection_take (struct connection *c, size_t length)
+{
+  char *head = arena_strndup (request_arena, c->buf + c->start, length);
+  c->start += length;
+  if (c->start == c->end)
+    c->start = c->end = 0;
+  return head;
+}
+
+
+// Reads the request body into the arena, starting
+// with what is already in the connection buffer
+static char *
+connection_read_body (struct connection *c, size_t length)
+{
+  char *body = (char *) arena_alloc (request_arena, length + 1);
+  if (NULL == body)
+    return NULL;
+
+  size_t have = c->end - c->start;
+  if (have > length)
+    have = length;
+  memcpy (body, c->buf + c->start, have);
+  c->start += have;
+  if (c->start == c->end)
+    c->start = c->end = 0;
+
+  while (have < length)
+    {
+      ssize_t got = recv (c->fd, body + have, length - have, 0);
+      if ((got < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+        {
+          if (connection_expired (c))
+            return NULL;
+          continue;
+        }
+      if ((got < 0) && (EINTR == errno))
+        continue;
+      if (got <= 0)
+        return NULL;
+      have += got;
+    }
+  body[length] = '\0';
+  return body;
+}
+
+
+static int
+env_init (struct environment *env)
+{
+  env->count = 0;
+  env->size = 32;
+  env->envp = (char **) arena_alloc (request_arena,
+                                     env->size * sizeof (char *));
+  if (NULL == env->envp)
+    return -1;
+  env->envp[0] = NULL;
+  return 0;
+}
+
+
+// Adds "name=value", the name is taken as is
+static char *
+env_add (struct environment *env, const char *name, size_t name_len,
+         const char *value, size_t value_len)
+{
+  // One slot is kept for the terminating NULL
+  if (env->count + 1 >= env->size)
+    {
+      int size = 2 * env->size;
+      char **envp = (char **) arena_alloc (request_arena,
+                                           size * sizeof (char *));
+      if (NULL == envp)
+        return NULL;
+      memcpy (envp, env->envp, env->count * sizeof (char *));
+      env->envp = envp;
+      env->size = size;
+    }
+
+  char *var = (char *) arena_alloc (request_arena, name_len + value_len + 2);
+  if (NULL == var)
+    return NULL;
+  memcpy (var, name, name_len);
+  var[name_len] = '=';
+  memcpy (var + name_len + 1, value, value_len);
+  var[name_len + 1 + value_len] = '\0';
+
+  env->envp[env->count++] = var;
+  env->envp[env->count] = NULL;
+  return var;
+}
+
+
+static char *
+env_set (struct environment *env, const char *name, const char *value)
+{
+  return env_add (env, name, strlen (name), value, strlen (value));
+}
+
+
+static void
+input_eof (FCGX_Stream * stream)
+{
+  stream->isClosed = 1;
+}
+
+
+// Runs dispatch() as if the request came over FastCGI.
+// The CGI response is left in `response', returns the exit status.
+static int
+serve_request (struct environment *env, char *body, size_t length,
+               struct output_buffer *response)
+{
+  FCGX_Request request;
+  FCGX_Stream in;
+
+  memset (&in, 0, sizeof (in));
+  in.isReader = 1;
+  in.rdNext = in.stopUnget = (unsigned char *) body;
+  in.stop = (unsigned char *) body + length;
+  in.fillBuffProc = input_eof;
+
+  memset (&request, 0, sizeof (request));
+  request.ipcFd = -1;
+  request.envp = env->envp;
+  request.in = &in;
+  output_buffer_init (response);
+  request.out = &response->stream;
+
+  timing_accepted (FCGX_GetParam ("REQUEST_URI", env->envp));
+  dispatch (&request);
+  timing_enter (TIMING_FLUSH);
+  return request_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+static bool
+parse_length (const char *str, size_t *length)
+{
+  char *end;
+
+  if ((NULL == str) || ('\0' == *str))
+    {
+      *length = 0;
+      return true;
+    }
+  if (('0' > *str) || ('9' < *str))
+    return false;
+
+  errno = 0;
+  unsigned long long n = strtoull (str, &end, 10);
+  if ((0 != errno) || ('\0' != *end))
+    return false;
+
+  *length = n;
+  return true;
+}
+
+
+// Turns the CGI response into an HTTP one: the Status header
+// becomes the status line, Content-Length and Connection are added
+static int
+http_send_response (struct connection *c, struct output_buffer *response,
+                    bool head_only, bool keep_alive)
+{
+  char *data = (char *) response->data;
+  size_t length = output_buffer_length (response);
+  char *body = (0 == response->stream.FCGI_errno) ?
+    memmem (data, length, "\r\n\r\n", 4) : NULL;
+
+  if (NULL == body)
+    {
+      debug ("no complete response headers");
+      send_string (c->fd, HTTP_ERROR ("500 Internal Server Error"));
+      return -1;
+    }
+
+  body += 2;
+  *body = '\0';
+  body += 2;
+  size_t body_length = length - (body - data);
+
+  const char *status = "200 OK";
+  int status_len = 6;
+  for (char *line = data; '\0' != *line;)
+    {
+      char *next = strstr (line, "\r\n");
+      if (0 == strncasecmp (line, "Status:", 7))
+        {
+          status = line + 7;
+          while (' ' == *status)
+            ++status;
+          status_len = next - status;
+        }
+      line = next + 2;
+    }
+
+  size_t size = (body - data) + status_len + 128;
+  char *head = (char *) arena_alloc (request_arena, size);
+  if (NULL == head)
+    return -1;
+
+  int n = snprintf (head, size, "HTTP/1.1 %.*s\r\n", status_len, status);
+  for (char *line = data; '\0' != *line;)
+    {
+      char *next = strstr (line, "\r\n") + 2;
+      if (0 != strncasecmp (line, "Status:", 7))
+        {
+          memcpy (head + n, line, next - line);
+          n += next - line;
+        }
+      line = next;
+    }
+  n += snprintf (head + n, size - n,
+                 "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+                 body_length, keep_alive ? "keep-alive" : "close");
+
+  struct iovec iov[2] = {
+    {.iov_base = head,.iov_len = n},
+    {.iov_base = body,.iov_len = head_only ? 0 : body_length}
+  };
+  return send_all (c->fd, iov, 2);
+}
+
+
+// Maps a header to its CGI variable, e.g. Accept-Encoding
+// to HTTP_ACCEPT_ENCODING. Names with underscores are dropped
+// so that they cannot pose as dashed ones.
+static char *
+http_add_header (struct environment *env, const char *name,
+                 size_t name_len, const char *value, size_t value_len)
+{
+  char var[name_len + 6];
+  size_t n = 0;
+
+  if ((14 != name_len) || (0 != strncasecmp (name, "Content-Length", 14)))
+    if ((12 != name_len) || (0 != strncasecmp (name, "Content-Type", 12)))
+      {
+        memcpy (var, "HTTP_", 5);
+        n = 5;
+      }
+
+  for (size_t i = 0; i < name_len; ++i)
+    {
+      char ch = name[i];
+      if ('-' == ch)
+        ch = '_';
+      else if ((('a' <= ch) && ('z' >= ch)))
+        ch -= 'a' - 'A';
+      else if (!((('A' <= ch) && ('Z' >= ch)) || (('0' <= ch) && ('9' >= ch))))
+        return (char *) "";     // dropped, not an error
+      var[n++] = ch;
+    }
+
+  return env_add (env, var, n, value, value_len);
+}
+
+
+// Parses the request head into `env'. Returns NULL
+// on success, or the status of the error response.
+static const char *
+http_parse_head (struct connection *c, char *head, struct environment *env,
+                 bool *keep_alive, bool *expect_continue)
+{
+  char *eol = strstr (head, "\r\n");
+  *eol = '\0';
+
+  // Request-Line = Method SP Request-URI SP HTTP-Version
+  char *method = head;
+  char *uri = strchr (method, ' ');
+  if (NULL == uri)
+    return "400 Bad Request";
+  *uri++ = '\0';
+  char *version = strchr (uri, ' ');
+  if (NULL == version)
+    return "400 Bad Request";
+  *version++ = '\0';
+
+  if (0 == strcmp (version, "HTTP/1.1"))
+    *keep_alive = true;
+  else if (0 == strcmp (version, "HTTP/1.0"))
+    *keep_alive = false;
+  else
+    return "505 HTTP Version Not Supported";
+
+  char *query = strchr (uri, '?');
+  if ((NULL == env_set (env, "REQUEST_METHOD", method))
+      || (NULL == env_set (env, "REQUEST_URI", uri))
+      || (NULL == env_set (env, "QUERY_STRING",
+                           (NULL == query) ? "" : query + 1))
+      || (NULL == env_set (env, "SERVER_PROTOCOL", version))
+      || (NULL == env_set (env, "REMOTE_ADDR", c->remote_addr)))
+    return "500 Internal Server Error";
+
+  *expect_continue = false;
+  for (char *line = eol + 2; '\0' != *line; line = eol + 2)
+    {
+      eol = strstr (line, "\r\n");
+      *eol = '\0';
+
+      char *colon = strchr (line, ':');
+      // No obsolete line folding, no space before the colon
+      if ((NULL == colon) || (colon == line) || (' ' == colon[-1])
+          || ('\t' == colon[-1]))
+        return "400 Bad Request";
+
+      char *value = colon + 1;
+      while ((' ' == *value) || ('\t' == *value))
+        ++value;
+      char *end = eol;
+      while ((end > value) && ((' ' == end[-1]) || ('\t' == end[-1])))
+        --end;
+      *end = '\0';
+
+      size_t name_len = colon - line;
+      if ((10 == name_len) && (0 == strncasecmp (line, "Connection", 10)))
+        {
+          if (NULL != strcasestr (value, "close"))
+            *keep_alive = false;
+          else if (NULL != strcasestr (value, "keep-alive"))
+            *keep_alive = true;
+        }
+      else if ((17 == name_len)
+               && (0 == strncasecmp (line, "Transfer-Encoding", 17)))
+        return "501 Not Implemented";
+      else if ((6 == name_len) && (0 == strncasecmp (line, "Expect", 6)))
+        {
+          if (0 != strcasecmp (value, "100-continue"))
+            return "417 Expectation Failed";
+          *expect_continue = true;
+        }
+
+      if (NULL == http_add_header (env, line, name_len, value, end - value))
+        return "500 Internal Server Error";
+    }
+
+  return NULL;
+}
+
+
+static void
+http_serve (struct connection *c, struct timing *timing)
+{
+  bool keep_alive = true;
+
+  while (keep_alive)
+    {
+      // Idle connections do not count as request time
+      if (c->start == c->end)
+        {
+          connection_set_deadline (c, true);
+          if (connection_read (c) <= 0)
+            return;
+        }
+      connection_set_deadline (c, false);
+      timing_start (timing);
+
+      char *end;
+      while (NULL == (end = memmem (c->buf + c->start, c->end - c->start,
+                                    "\r\n\r\n", 4)))
+        {
+          if (HEAD_MAX == c->end - c->start)
+            {
+              send_string (c->fd,
+                           HTTP_ERROR ("431 Request Header Fields Too Large"));
+              return;
+            }
+          if (connection_read (c) <= 0)
+            return;
+        }
+
+      size_t head_len = end + 2 - (c->buf + c->start);
+      char *head = connection_take (c, head_len + 2);
+      struct environment env;
+      bool expect_continue;
+      const char *error = "500 Internal Server Error";
+      if (NULL != head)
+        head[head_len] = '\0';     // each line ends with CRLF
+      if ((NULL != head) && (0 == env_init (&env)))
+        error = http_parse_head (c, head, &env, &keep_alive,
+                                 &expect_continue);
+
+      size_t length = 0;
+      if ((NULL == error)
+          && !parse_length (FCGX_GetParam ("CONTENT_LENGTH", env.envp),
+                            &length))
+        error = "400 Bad Request";
+      else if (length > BODY_MAX)
+        error = "413 Payload Too Large";
+
+      if (NULL != error)
+        {
+          // The rest of the stream cannot be trusted
+          debug ("bad HTTP request: %s", error);
+          char *response = arena_alloc (request_arena, strlen (error) + 80);
+          if (NULL != response)
+            {
+              sprintf (response, HTTP_ERROR ("%s"), error);
+              send_string (c->fd, response);
+            }
+          return;
+        }
+
+      if (expect_continue && (length > c->end - c->start))
+        send_string (c->fd, "HTTP/1.1 100 Continue\r\n\r\n");
+
+      char *body = connection_read_body (c, length);
+      if (NULL == body)
+        return;
+
+      struct output_buffer response;
+      int status = serve_request (&env, body, length, &response);
+      bool head_only =
+        (0 == strcmp (FCGX_GetParam ("REQUEST_METHOD", env.envp), "HEAD"));
+      if (0 != http_send_response (c, &response, head_only, keep_alive))
+        keep_alive = false;
+      output_buffer_free (&response);
+
+      timing_finish (status);
+      arena_reset (request_arena);
+    }
+}
+
+
+// SCGI request is a netstring of NUL-separated headers,
+// CONTENT_LENGTH first, followed by the body:
+// "70:CONTENT_LENGTH\0" "27\0" "SCGI\0" "1\0" ... "," <body>
+// The response is the CGI one, the connection is closed after it.
+static void
+scgi_serve (struct connection *c, struct timing *timing)
+{
+  char *colon;
+
+  // SCGI connections carry one request: the deadline runs from accept()
+  connection_set_deadline (c, false);
+  if (connection_read (c) <= 0)
+    return;
+  timing_start (timing);
+
+  while (NULL == (colon = memchr (c->buf + c->start, ':', c->end - c->start)))
+    {
+      if (c->end - c->start > 8)
+        return;
+      if (connection_read (c) <= 0)
+        return;
+    }
+
+  size_t length = 0;
+  for (char *p = c->buf + c->start; p < colon; ++p)
+    {
+      if (('0' > *p) || ('9' < *p))
+        return;
+      length = length * 10 + (*p - '0');
+      if (length > HEAD_MAX / 2)
+        return;
+    }
+
+  c->start = colon + 1 - c->buf;
+  while (c->end - c->start < length + 1)
+    if (connection_read (c) <= 0)
+      return;
+
+  char *headers = connection_take (c, length + 1);
+  if ((NULL == headers) || (',' != headers[length])
+      || ((length > 0) && ('\0' != headers[length - 1])))
+    {
+      debug ("bad SCGI netstring");
+      return;
+    }
+
+  struct environment env;
+  if (0 != env_init (&env))
+    return;
+  for (char *name = headers; name < headers + length;)
+    {
+      char *value = name + strlen (name) + 1;
+      if (value >= headers + length)
+        {
+          debug ("bad SCGI header `%s'", name);
+          return;
+        }
+      if (NULL == env_add (&env, name, strlen (name), value, strlen (value)))
+        return;
+      name = value + strlen (value) + 1;
+    }
+
+  if (!parse_length (FCGX_GetParam ("CONTENT_LENGTH", env.envp), &length)
+      || (length > BODY_MAX))
+    {
+      debug ("bad SCGI request length");
+      return;
+    }
+  char *body = connection_read_body (c, length);
+  if (NULL == body)
+    return;
+
+  struct output_buffer response;
+  int status = serve_request (&env, body, length, &response);
+  struct iovec iov = {.iov_base = response.data,
+    .iov_len = output_buffer_length (&response)
+  };
+  send_all (c->fd, &iov, 1);
+  output_buffer_free (&response);
+
+  timing_finish (status);
+}
+
+
+static void
+connection_init (struct connection *c, const struct sockaddr_storage *sa)
+{
+  c->start = c->end = 0;
+  c->remote_addr[0] = '\0';
+
+  if (AF_INET == sa->ss_family)
+    inet_ntop (AF_INET, &((const struct sockaddr_in *) sa)->sin_addr,
+               c->remote_addr, sizeof (c->remote_addr));
+  else if (AF_INET6 == sa->ss_family)
+    inet_ntop (AF_INET6, &((const struct sockaddr_in6 *) sa)->sin6_addr,
+               c->remote_addr, sizeof (c->remote_addr));
+
+  if (AF_UNIX != sa->ss_family)
+    {
+      // Responses go out with a single sendmsg() each
+      int on = 1;
+      setsockopt (c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    }
+
+  struct timeval tv = {.tv_sec = IDLE_TIMEOUT,.tv_usec = 0 };
+  setsockopt (c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  // Deadlines are checked by connection_expired() between slices
+  tv.tv_sec = 0;
+  tv.tv_usec = READ_SLICE * 1000;
+  setsockopt (c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+}
+
+
+// Thread serving one connection at a time from the listener
+void *
+listener_worker (void *param)
+{
+  struct listener *l = (struct listener *) param;
+  struct connection c;
+  struct timing timing;
+
+  debug ("%s listener thread on `%s' started",
+         (LISTENER_HTTP == l->protocol) ? "HTTP" : "SCGI", l->address);
+
+  request_arena = arena_new (arena_size);
+  c.buf = (char *) malloc (HEAD_MAX);
+  if ((NULL == request_arena) || (NULL == c.buf))
+    {
+      debug ("listener thread failed to allocate buffers");
+      arena_destroy (request_arena);
+      free (c.buf);
+      return NULL;
+    }
+  profile_register ();
+  c.listener = l;
+
+  while (1)
+    {
+      struct sockaddr_storage sa;
+      socklen_t sa_len = sizeof (sa);
+
+      // Blocking accept() wakes up a single thread. While one is there,
+      // idle keep-alive connections are left alone
+      __atomic_store_n (&l->yielding, 0, __ATOMIC_RELEASE);
+      __atomic_add_fetch (&l->accepting, 1, __ATOMIC_ACQ_REL);
+      c.fd = accept (l->fd, (struct sockaddr *) &sa, &sa_len);
+      __atomic_sub_fetch (&l->accepting, 1, __ATOMIC_ACQ_REL);
+      if (c.fd < 0)
+        {
+          if ((EINTR == errno) || (ECONNABORTED == errno))
+            continue;
+          debug ("accept() failed: %s", strerror (errno));
+          break;
+        }
+
+      connection_init (&c, &sa);
+      if (LISTENER_HTTP == l->protocol)
+        http_serve (&c, &timing);
+      else
+        scgi_serve (&c, &timing);
+
+      close (c.fd);
+      request_timing = NULL;
+      arena_reset (request_arena);
+    }
+
+  free (c.buf);
+  arena_destroy (request_arena);
+  return NULL;
+}
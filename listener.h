@@ -0,0 +1,52 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _LISTENER_H
+#define _LISTENER_H
+
+// Built-in HTTP/1.1 and SCGI listeners. Requests are turned
+// into FCGX_Requests without an IPC connection (ipcFd = -1)
+// and go through the same dispatch() as FastCGI ones.
+enum listener_protocol
+{
+  LISTENER_HTTP,
+  LISTENER_SCGI
+};
+
+struct listener
+{
+  struct listener *next;
+  enum listener_protocol protocol;
+  const char *address;          // ":port", "host:port" or a socket path
+  int fd;
+  int accepting;                // threads blocked in accept()
+  int yielding;                 // an idle connection is being closed
+};
+
+extern struct listener *listeners;
+
+int listener_add (enum listener_protocol, const char *);
+int listener_open (struct listener *, int);
+void *listener_worker (void *);
+
+#endif // _LISTENER_H
@@ -27,19 +27,39 @@ THE SOFTWARE.
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <fcgiapp.h>
 
 #ifdef ENABLE_CGROUPS
 #include <libcgroup.h>
+#include "backend.h"
+#include "cgroups.h"
+#include "changes.h"
+#include "dircache.h"
+#include "export.h"
+#include "history.h"
 #endif
 
+#include "admission.h"
+#include "aggregate.h"
+#include "arena.h"
+#include "compress.h"
 #include "dispatch.h"
+#include "listener.h"
+#include "pool.h"
+#include "profile.h"
+#include "timing.h"
 #include "uri.h"
 #include "debug.h"
 
@@ -47,18 +67,24 @@ static const char *progname;
 
 /* Tunable parameters: */
 static int number_of_workers = 5;
+static int number_of_processes = 0;     // no forking
 static const char *socket_path = ":9000";
 static int backlog = 16;
+static size_t stack_size = 0;   // use system default
 
 static pthread_mutex_t accept_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t *pthread_ids = NULL;
 static int socket = -1;
 
+static pid_t *children = NULL;
+static volatile sig_atomic_t stopping = 0;
+
 
 static void *
 worker (void *param)
 {
   FCGX_Request request;
+  struct timing timing;
 
   debug ("thread #%" PRIdPTR " started", (intptr_t) param);
   if (0 != FCGX_InitRequest (&request, socket, /* int flags */ 0))
@@ -66,8 +92,17 @@ worker (void *param)
       return (NULL);
     }
 
+  request_arena = arena_new (arena_size);
+  if (NULL == request_arena)
+    {
+      debug ("thread #%" PRIdPTR " arena_new() failed", (intptr_t) param);
+      return (NULL);
+    }
+  profile_register ();
+
   while (1)
     {
+      timing_start (&timing);
       pthread_mutex_lock (&accept_mutex);
       int rc = FCGX_Accept_r (&request);
       pthread_mutex_unlock (&accept_mutex);
@@ -80,10 +115,16 @@ worker (void *param)
           break;
         }
 
+      timing_accepted (FCGX_GetParam ("REQUEST_URI", request.envp));
       dispatch (&request);
 
+      timing_enter (TIMING_FLUSH);
       FCGX_Finish_r (&request);
+      timing_finish (request_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+      arena_reset (request_arena);
     }
+
+  arena_destroy (request_arena);
   return NULL;
 }
 
@@ -112,26 +153,130 @@ usage (void)
   printf ("  -s, --socket={path|:port}  a socket or a port number (%s)\n",
           socket_path);
   printf ("  -b, --backlog=number       listen queue depth (%d)\n", backlog);
+  printf ("      --http={path|[host]:port}  serve plain HTTP/1.1 there too\n");
+  printf ("      --scgi={path|[host]:port}  serve SCGI there too\n");
   printf ("  -w, --threads=number       number of threads to run (%d)\n",
           number_of_workers);
+  printf ("  -p, --processes=number     worker processes, 0 is no fork (%d)\n",
+          number_of_processes);
   printf ("  -u, --uri-prefix=string    URI prefix to trim (%s)\n",
           uri_prefix);
+  printf ("  -S, --stack-size=KiB       thread stack size, 0 is default (%zu)\n",
+          stack_size / 1024);
+  printf ("  -a, --arena-size=KiB       per-worker request memory (%zu)\n",
+          arena_size / 1024);
+  printf ("      --walk-threads=number  threads for large walks, 0 is off (%d)\n",
+          pool_size);
+#ifdef ENABLE_CGROUPS
+  printf ("      --walk-threshold=number  subgroups to walk in parallel (%d)\n",
+          cgroups_walk_threshold);
+  printf ("      --history-interval=seconds  sample usage counters, 0 is off (%d)\n",
+          history_interval);
+  printf ("      --history-samples=number  samples kept per group (%d)\n",
+          history_samples);
+  printf ("      --history-groups=number  groups sampled per counter (%d)\n",
+          history_groups);
+  printf ("      --track-interval=seconds  look for changes, 0 is off (%d)\n",
+          changes_interval);
+  printf ("      --track-changes=number  changes kept for ?since (%d)\n",
+          changes_max);
+  printf ("      --export=file          publish tracked snapshots there\n");
+  printf ("      --dir-cache=number     group directories kept open, 0 is off (%d)\n",
+          dircache_size);
+#endif
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+  printf ("      --compress-threshold=bytes  smallest response to compress,\n"
+          "                             0 disables compression (%zu)\n",
+          compress_threshold);
+#endif
+  printf ("      --slow-log=ms          log requests slower than that, 0 is off (%ld)\n",
+          slow_request_ms);
+  printf ("      --slow-log-sample=number  log every n-th slow request (%d)\n",
+          slow_request_sample);
+  printf ("      --limit=route:number   requests of a route at once, route\n"
+          "                             `*' is any other, may be repeated,\n"
+          "                             per process like --rate\n");
+  printf ("      --rate=number          requests per second per client, 0 is off\n");
+  printf ("      --burst=number         requests a client may save up (rate)\n");
+  printf ("      --queue-deadline=ms    refuse requests queued longer, 0 is off (%ld)\n",
+          queue_deadline_ms);
+  printf ("      --upstream=name=address[,ms]  daemon to query with /aggregate/,\n"
+          "                             may be repeated\n");
+  printf ("      --upstream-timeout=ms  default upstream timeout (%ld)\n",
+          upstream_timeout_ms);
+  printf ("      --profile-max=seconds  longest /debug/profile, 0 is off (%d)\n",
+          profile_max_seconds);
   printf ("  -h, --help                 show this help message\n");
   printf ("  -v, --version              show version\n");
   exit (0);
 }
 
 
+// Long options without short equivalents
+enum
+{
+  OPT_WALK_THREADS = 256,
+  OPT_WALK_THRESHOLD,
+  OPT_COMPRESS_THRESHOLD,
+  OPT_SLOW_LOG,
+  OPT_SLOW_LOG_SAMPLE,
+  OPT_LIMIT,
+  OPT_RATE,
+  OPT_BURST,
+  OPT_QUEUE_DEADLINE,
+  OPT_HTTP,
+  OPT_SCGI,
+  OPT_UPSTREAM,
+  OPT_UPSTREAM_TIMEOUT,
+  OPT_PROFILE_MAX,
+  OPT_HISTORY_INTERVAL,
+  OPT_HISTORY_SAMPLES,
+  OPT_HISTORY_GROUPS,
+  OPT_TRACK_INTERVAL,
+  OPT_TRACK_CHANGES,
+  OPT_EXPORT,
+  OPT_DIR_CACHE
+};
+
+
 static void
 parse_options (int argc, char **argv)
 {
-  static const char *short_options = "s:b:w:u:hv";
+  static const char *short_options = "s:b:w:p:u:S:a:hv";
 
   static const struct option long_options[] = {
     {"socket", required_argument, NULL, 's'},
     {"backlog", required_argument, NULL, 'b'},
+    {"http", required_argument, NULL, OPT_HTTP},
+    {"scgi", required_argument, NULL, OPT_SCGI},
+    {"upstream", required_argument, NULL, OPT_UPSTREAM},
+    {"upstream-timeout", required_argument, NULL, OPT_UPSTREAM_TIMEOUT},
+    {"profile-max", required_argument, NULL, OPT_PROFILE_MAX},
     {"threads", required_argument, NULL, 'w'},
+    {"processes", required_argument, NULL, 'p'},
     {"uri-prefix", required_argument, NULL, 'u'},
+    {"stack-size", required_argument, NULL, 'S'},
+    {"arena-size", required_argument, NULL, 'a'},
+    {"walk-threads", required_argument, NULL, OPT_WALK_THREADS},
+#ifdef ENABLE_CGROUPS
+    {"walk-threshold", required_argument, NULL, OPT_WALK_THRESHOLD},
+    {"history-interval", required_argument, NULL, OPT_HISTORY_INTERVAL},
+    {"history-samples", required_argument, NULL, OPT_HISTORY_SAMPLES},
+    {"history-groups", required_argument, NULL, OPT_HISTORY_GROUPS},
+    {"track-interval", required_argument, NULL, OPT_TRACK_INTERVAL},
+    {"track-changes", required_argument, NULL, OPT_TRACK_CHANGES},
+    {"export", required_argument, NULL, OPT_EXPORT},
+    {"dir-cache", required_argument, NULL, OPT_DIR_CACHE},
+#endif
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+    {"compress-threshold", required_argument, NULL, OPT_COMPRESS_THRESHOLD},
+#endif
+    {"slow-log", required_argument, NULL, OPT_SLOW_LOG},
+    {"slow-log-sample", required_argument, NULL, OPT_SLOW_LOG_SAMPLE},
+    {"limit", required_argument, NULL, OPT_LIMIT},
+    {"rate", required_argument, NULL, OPT_RATE},
+    {"burst", required_argument, NULL, OPT_BURST},
+    {"queue-deadline", required_argument, NULL, OPT_QUEUE_DEADLINE},
     {"help", no_argument, NULL, 'h'},
     {"version", no_argument, NULL, 'v'},
     {NULL, 0, NULL, 0}
@@ -168,10 +313,230 @@ parse_options (int argc, char **argv)
             exit (1);
           }
         break;
+      case 'p':
+        number_of_processes = atoi (optarg);
+        if (number_of_processes < 0)
+          {
+            fprintf (stderr,
+                     "%s: number of processes must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
       case 'u':
         uri_prefix = optarg;
         uri_prefix_len = strlen (uri_prefix);
         break;
+      case 'S':
+        if (atoi (optarg) < 0)
+          {
+            fprintf (stderr, "%s: stack size must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        stack_size = (size_t) atoi (optarg) * 1024;
+        if ((0 != stack_size) && (stack_size < (size_t) PTHREAD_STACK_MIN))
+          {
+            fprintf (stderr,
+                     "%s: stack size must be at least %d KiB\n",
+                     progname, (int) (PTHREAD_STACK_MIN / 1024));
+            exit (1);
+          }
+        break;
+      case 'a':
+        if (atoi (optarg) <= 0)
+          {
+            fprintf (stderr,
+                     "%s: arena size must be a positive integer\n",
+                     progname);
+            exit (1);
+          }
+        arena_size = (size_t) atoi (optarg) * 1024;
+        break;
+      case OPT_WALK_THREADS:
+        pool_size = atoi (optarg);
+        if (pool_size < 0)
+          {
+            fprintf (stderr,
+                     "%s: number of walk threads must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
+#ifdef ENABLE_CGROUPS
+      case OPT_WALK_THRESHOLD:
+        cgroups_walk_threshold = atoi (optarg);
+        if (cgroups_walk_threshold <= 0)
+          {
+            fprintf (stderr,
+                     "%s: walk threshold must be a positive integer\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_HISTORY_INTERVAL:
+        history_interval = atoi (optarg);
+        if (history_interval < 0)
+          {
+            fprintf (stderr,
+                     "%s: history interval must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_HISTORY_SAMPLES:
+        history_samples = atoi (optarg);
+        if (history_samples < 2)
+          {
+            fprintf (stderr,
+                     "%s: number of history samples must be at least 2\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_HISTORY_GROUPS:
+        history_groups = atoi (optarg);
+        if (history_groups <= 0)
+          {
+            fprintf (stderr,
+                     "%s: number of history groups must be a positive integer\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_TRACK_INTERVAL:
+        changes_interval = atoi (optarg);
+        if (changes_interval < 0)
+          {
+            fprintf (stderr,
+                     "%s: track interval must not be negative\n", progname);
+            exit (1);
+          }
+        break;
+      case OPT_TRACK_CHANGES:
+        changes_max = atoi (optarg);
+        if (changes_max <= 0)
+          {
+            fprintf (stderr,
+                     "%s: number of changes must be a positive integer\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_EXPORT:
+        export_path = optarg;
+        break;
+      case OPT_DIR_CACHE:
+        dircache_size = atoi (optarg);
+        if (dircache_size < 0)
+          {
+            fprintf (stderr, "%s: directory cache must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
+#endif
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+      case OPT_COMPRESS_THRESHOLD:
+        if ((atoi (optarg) < 0) || (atoi (optarg) > COMPRESS_THRESHOLD_MAX))
+          {
+            fprintf (stderr,
+                     "%s: compress threshold must be between 0 and %d\n",
+                     progname, COMPRESS_THRESHOLD_MAX);
+            exit (1);
+          }
+        compress_threshold = atoi (optarg);
+        break;
+#endif
+      case OPT_SLOW_LOG:
+        slow_request_ms = atol (optarg);
+        if (slow_request_ms < 0)
+          {
+            fprintf (stderr,
+                     "%s: slow request time must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_SLOW_LOG_SAMPLE:
+        slow_request_sample = atoi (optarg);
+        if (slow_request_sample <= 0)
+          {
+            fprintf (stderr,
+                     "%s: slow log sample must be a positive integer\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_LIMIT:
+        if (0 != admission_add_limit (optarg))
+          {
+            fprintf (stderr, "%s: invalid route limit `%s'\n", progname,
+                     optarg);
+            exit (1);
+          }
+        break;
+      case OPT_RATE:
+        client_rate = atof (optarg);
+        if (client_rate < 0)
+          {
+            fprintf (stderr, "%s: rate must not be negative\n", progname);
+            exit (1);
+          }
+        break;
+      case OPT_BURST:
+        client_burst = atof (optarg);
+        if (client_burst < 1)
+          {
+            fprintf (stderr, "%s: burst must be at least 1\n", progname);
+            exit (1);
+          }
+        break;
+      case OPT_QUEUE_DEADLINE:
+        queue_deadline_ms = atol (optarg);
+        if (queue_deadline_ms < 0)
+          {
+            fprintf (stderr, "%s: queue deadline must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_HTTP:
+      case OPT_SCGI:
+        if (0 != listener_add ((OPT_HTTP == opt) ? LISTENER_HTTP :
+                               LISTENER_SCGI, optarg))
+          {
+            fprintf (stderr, "%s: listener_add() failed: %s\n", progname,
+                     strerror (errno));
+            exit (1);
+          }
+        break;
+      case OPT_UPSTREAM:
+        if (0 != upstream_add (optarg))
+          {
+            fprintf (stderr, "%s: invalid upstream `%s'\n", progname,
+                     optarg);
+            exit (1);
+          }
+        break;
+      case OPT_UPSTREAM_TIMEOUT:
+        upstream_timeout_ms = atol (optarg);
+        if (upstream_timeout_ms <= 0)
+          {
+            fprintf (stderr, "%s: upstream timeout must be positive\n",
+                     progname);
+            exit (1);
+          }
+        break;
+      case OPT_PROFILE_MAX:
+        profile_max_seconds = atoi (optarg);
+        if (profile_max_seconds < 0)
+          {
+            fprintf (stderr, "%s: profile time must not be negative\n",
+                     progname);
+            exit (1);
+          }
+        break;
       case 'h':
         usage ();
         break;
@@ -183,6 +548,35 @@ parse_options (int argc, char **argv)
         exit (1);
         break;
       }
+
+#ifdef ENABLE_CGROUPS
+  // Logs of processes would be mixed up: a generation of one
+  // may pass for a recent one in another, with no resync
+  if ((0 != changes_interval) && (0 != number_of_processes))
+    {
+      fprintf (stderr, "%s: --track-interval needs no --processes\n",
+               progname);
+      exit (1);
+    }
+
+  // Every process would sample on its own, and a request would
+  // only see the history of the process that serves it
+  if ((0 != history_interval) && (0 != number_of_processes))
+    {
+      fprintf (stderr, "%s: --history-interval needs no --processes\n",
+               progname);
+      exit (1);
+    }
+
+  // One writer of the file, which publishes what it tracks
+  if ((NULL != export_path)
+      && ((0 == changes_interval) || (0 != number_of_processes)))
+    {
+      fprintf (stderr, "%s: --export needs --track-interval "
+               "and no --processes\n", progname);
+      exit (1);
+    }
+#endif
 }
 
 
@@ -196,39 +590,62 @@ init_libraries (void)
       fprintf (stderr, "%s: FCGX_Init() failed. Exiting.\n", progname);
       exit (EXIT_FAILURE);
     }
-#ifdef ENABLE_CGROUPS
-  debug ("initializing libcgroup");
-  if (0 != (rc = cgroup_init ()))
-    {
-      fprintf (stderr, "%s: cgroup_init() failed. Exiting.\n", progname);
-      exit (EXIT_FAILURE);
-    }
-#endif
+  // libcgroup is initialized on first use, see backend.c
 }
 
 
-int
-main (int argc, char **argv)
+// Runs worker threads, in this process or in a forked one
+static int
+serve (void)
 {
-  parse_options (argc, argv);
-
-  init_libraries ();
-
-  fprintf (stderr,
-           "%s: socket `%s', backlog %d, %d worker%s, URI prefix `%s'\n",
-           progname, socket_path, backlog, number_of_workers,
-           (number_of_workers == 1 ? "" : "s"), uri_prefix);
+  debug ("starting %d walk threads", pool_size);
+  if (0 != pool_start ())
+    {
+      fprintf (stderr, "%s: pool_start() failed: %s. Exiting.\n", progname,
+               strerror (errno));
+      return (EXIT_FAILURE);
+    }
 
-  socket = FCGX_OpenSocket (socket_path, backlog);
-  if (socket < 0)
+#ifdef ENABLE_CGROUPS
+  if (0 != backend_start ())
     {
-      fprintf (stderr, "%s: FCGX_OpenSocket() failed: %s. Exiting.\n",
+      fprintf (stderr, "%s: backend_start() failed: %s. Exiting.\n",
+               progname, strerror (errno));
+      return (EXIT_FAILURE);
+    }
+  if (0 != dircache_start ())
+    {
+      fprintf (stderr, "%s: dircache_start() failed: %s. Exiting.\n",
+               progname, strerror (errno));
+      return (EXIT_FAILURE);
+    }
+  if (0 != history_start ())
+    {
+      fprintf (stderr, "%s: history_start() failed: %s. Exiting.\n",
+               progname, strerror (errno));
+      return (EXIT_FAILURE);
+    }
+  if (0 != export_start ())
+    {
+      fprintf (stderr, "%s: cannot export to `%s': %s. Exiting.\n",
+               progname, export_path, strerror (errno));
+      return (EXIT_FAILURE);
+    }
+  if (0 != changes_start ())
+    {
+      fprintf (stderr, "%s: changes_start() failed: %s. Exiting.\n",
                progname, strerror (errno));
       return (EXIT_FAILURE);
     }
+#endif
+
+  // Every built-in listener gets as many threads as FastCGI
+  int number_of_threads = number_of_workers;
+  for (struct listener * l = listeners; NULL != l; l = l->next)
+    number_of_threads += number_of_workers;
 
-  debug ("allocating space for %d threads", number_of_workers);
-  pthread_ids = (pthread_t *) malloc (sizeof (pthread_t) * number_of_workers);
+  debug ("allocating space for %d threads", number_of_threads);
+  pthread_ids = (pthread_t *) malloc (sizeof (pthread_t) * number_of_threads);
   if (NULL == pthread_ids)
     {
       fprintf (stderr, "%s: malloc() failed: %s. Exiting.\n", progname,
@@ -236,17 +653,41 @@ main (int argc, char **argv)
       return (EXIT_FAILURE);
     }
 
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  if (0 != stack_size)
+    {
+      debug ("setting stack size to %zu bytes", stack_size);
+      int rc = pthread_attr_setstacksize (&attr, stack_size);
+      if (0 != rc)
+        {
+          fprintf (stderr, "%s: pthread_attr_setstacksize() failed: %s. "
+                   "Exiting.\n", progname, strerror (rc));
+          return (EXIT_FAILURE);
+        }
+    }
+
   debug ("starting threads");
-  for (int thr = 0; thr < number_of_workers; ++thr)
+  struct listener *l = listeners;
+  for (int thr = 0; thr < number_of_threads; ++thr)
     {
+      void *(*start) (void *) = worker;
+      void *param = (void *) ((intptr_t) thr);
+      if (thr >= number_of_workers)
+        {
+          // Listener threads go after the FastCGI ones
+          if ((thr > number_of_workers) && (0 == thr % number_of_workers))
+            l = l->next;
+          start = listener_worker;
+          param = l;
+        }
+
       int rc;
       do
         {
           debug ("starting thread #%d", thr);
           errno = 0;
-          rc =
-            pthread_create (&(pthread_ids[thr]), NULL, worker,
-                            (void *) ((intptr_t) thr));
+          rc = pthread_create (&(pthread_ids[thr]), &attr, start, param);
         }
       while ((0 != rc) && (EAGAIN == errno));
 
@@ -257,8 +698,9 @@ main (int argc, char **argv)
           return (EXIT_FAILURE);
         }
     }
+  pthread_attr_destroy (&attr);
 
-  for (int thr = 0; thr < number_of_workers; ++thr)
+  for (int thr = 0; thr < number_of_threads; ++thr)
     {
       int rc = pthread_join (pthread_ids[thr], NULL);
       if (0 != rc)
@@ -271,3 +713,198 @@ main (int argc, char **argv)
 
   return (EXIT_SUCCESS);
 }
+
+
+// Signals the supervisor waits for, blocked but in sigsuspend()
+static void
+supervisor_signals (sigset_t * set)
+{
+  sigemptyset (set);
+  sigaddset (set, SIGTERM);
+  sigaddset (set, SIGINT);
+  sigaddset (set, SIGCHLD);
+}
+
+
+static pid_t
+spawn_process (int n)
+{
+  // Signals are blocked, so the child cannot run the supervisor's
+  // handlers before it resets them
+  pid_t pid = fork ();
+  if (0 == pid)
+    {
+      sigset_t set;
+      supervisor_signals (&set);
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGINT, SIG_DFL);
+      signal (SIGCHLD, SIG_DFL);
+      sigprocmask (SIG_UNBLOCK, &set, NULL);
+      debug ("process #%d started", n);
+      free (children);
+      exit (serve ());
+    }
+
+  if (pid < 0)
+    fprintf (stderr, "%s: fork() failed: %s\n", progname, strerror (errno));
+  return pid;
+}
+
+
+static void
+stop_supervisor (int sig)
+{
+  stopping = sig;
+}
+
+
+static void
+child_exited (int sig)
+{
+  // only to break sigsuspend()
+}
+
+
+// Forks worker processes sharing the listening socket
+// and restarts those that crash
+static int
+supervise (void)
+{
+  // A signal between checking `stopping' and waiting would be lost:
+  // they are blocked and delivered only within sigsuspend()
+  sigset_t blocked, waiting;
+  supervisor_signals (&blocked);
+  sigprocmask (SIG_BLOCK, &blocked, &waiting);
+  sigdelset (&waiting, SIGTERM);
+  sigdelset (&waiting, SIGINT);
+  sigdelset (&waiting, SIGCHLD);
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = stop_supervisor;
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+  sa.sa_handler = child_exited;
+  sigaction (SIGCHLD, &sa, NULL);
+
+  debug ("allocating space for %d processes", number_of_processes);
+  children = (pid_t *) calloc (number_of_processes, sizeof (pid_t));
+  if (NULL == children)
+    {
+      fprintf (stderr, "%s: calloc() failed: %s. Exiting.\n", progname,
+               strerror (errno));
+      return (EXIT_FAILURE);
+    }
+
+  int alive = 0;
+  for (int n = 0; n < number_of_processes; ++n)
+    {
+      children[n] = spawn_process (n);
+      if (children[n] < 0)
+        {
+          stopping = SIGTERM;
+          break;
+        }
+      alive++;
+    }
+
+  time_t last_restart = 0;
+  while (!stopping && (alive > 0))
+    {
+      int status;
+      pid_t pid = waitpid (-1, &status, WNOHANG);
+      if (0 == pid)
+        {
+          sigsuspend (&waiting);
+          continue;
+        }
+      if (pid < 0)
+        {
+          if (EINTR == errno)
+            continue;
+          break;
+        }
+
+      int n = 0;
+      while ((n < number_of_processes) && (children[n] != pid))
+        n++;
+      if (n == number_of_processes)
+        continue;
+
+      children[n] = 0;
+      alive--;
+
+      if (WIFEXITED (status) && (EXIT_SUCCESS == WEXITSTATUS (status)))
+        {
+          debug ("process #%d (%d) exited", n, (int) pid);
+          continue;
+        }
+
+      if (WIFSIGNALED (status))
+        fprintf (stderr, "%s: process #%d (%d) killed by signal %d\n",
+                 progname, n, (int) pid, WTERMSIG (status));
+      else
+        fprintf (stderr, "%s: process #%d (%d) exited with %d\n",
+                 progname, n, (int) pid, WEXITSTATUS (status));
+
+      // Do not spin if children die at once
+      if (time (NULL) - last_restart < 1)
+        sleep (1);
+      last_restart = time (NULL);
+
+      children[n] = spawn_process (n);
+      if (children[n] > 0)
+        alive++;
+    }
+
+  debug ("stopping %d processes", alive);
+  for (int n = 0; n < number_of_processes; ++n)
+    if (children[n] > 0)
+      kill (children[n], SIGTERM);
+  while ((waitpid (-1, NULL, 0) > 0) || (EINTR == errno))
+    ;
+
+  return stopping ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  parse_options (argc, argv);
+
+  init_libraries ();
+
+  fprintf (stderr,
+           "%s: socket `%s', backlog %d, %d worker%s, URI prefix `%s'\n",
+           progname, socket_path, backlog, number_of_workers,
+           (number_of_workers == 1 ? "" : "s"), uri_prefix);
+  if (number_of_processes > 0)
+    fprintf (stderr, "%s: %d process%s\n", progname, number_of_processes,
+             (number_of_processes == 1 ? "" : "es"));
+
+  socket = FCGX_OpenSocket (socket_path, backlog);
+  if (socket < 0)
+    {
+      fprintf (stderr, "%s: FCGX_OpenSocket() failed: %s. Exiting.\n",
+               progname, strerror (errno));
+      return (EXIT_FAILURE);
+    }
+
+  for (struct listener * l = listeners; NULL != l; l = l->next)
+    {
+      fprintf (stderr, "%s: %s on `%s'\n", progname,
+               (LISTENER_HTTP == l->protocol) ? "HTTP" : "SCGI", l->address);
+      if (0 != listener_open (l, backlog))
+        {
+          fprintf (stderr, "%s: cannot listen on `%s': %s. Exiting.\n",
+                   progname, l->address, strerror (errno));
+          return (EXIT_FAILURE);
+        }
+    }
+
+  if (number_of_processes > 0)
+    return supervise ();
+  else
+    return serve ();
+}
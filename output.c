@@ -0,0 +1,472 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+
+#include <fcgiapp.h>
+
+#include "arena.h"
+#include "output.h"
+#include "timing.h"
+#include "debug.h"
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define USE_ZEROCOPY 1
+#endif
+
+// FastCGI record: a header followed by up to 65535 bytes of content
+#define FCGI_VERSION_1 1
+#define FCGI_STDOUT 6
+#define FCGI_HEADER_LEN 8
+
+#define OUTPUT_CHUNK_SIZE (32 * 1024 - FCGI_HEADER_LEN)
+
+// Send buffered chunks once that much is collected
+#define OUTPUT_FLUSH_SIZE (8 * OUTPUT_CHUNK_SIZE)
+
+// Payloads smaller than that are cheaper to copy
+#define OUTPUT_ZEROCOPY_SIZE (128 * 1024)
+
+// Milliseconds to wait for the kernel to be done with zerocopy sends
+#define OUTPUT_ZEROCOPY_WAIT 5000
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct output_chunk
+{
+  struct output_chunk *next;
+  size_t length;
+  unsigned char header[FCGI_HEADER_LEN];        // must precede data
+  unsigned char data[OUTPUT_CHUNK_SIZE];
+};
+
+
+static void
+output_error (struct output *out, int err)
+{
+  debug ("output error: %s", strerror (err));
+  out->stream.isClosed = 1;
+  out->stream.FCGI_errno = err;
+}
+
+
+static void
+output_frame (struct output *out, struct output_chunk *chunk)
+{
+  int request_id = out->request->requestId;
+
+  chunk->header[0] = FCGI_VERSION_1;
+  chunk->header[1] = FCGI_STDOUT;
+  chunk->header[2] = (request_id >> 8) & 0xff;
+  chunk->header[3] = request_id & 0xff;
+  chunk->header[4] = (chunk->length >> 8) & 0xff;
+  chunk->header[5] = chunk->length & 0xff;
+  chunk->header[6] = 0;         // padding length
+  chunk->header[7] = 0;         // reserved
+}
+
+
+#ifdef USE_ZEROCOPY
+static long
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+// Chunks may be reused only when the kernel is done with them.
+// A peer that does not read holds them forever: then the connection
+// is reset, which makes the kernel drop the queued data, and the
+// chunks are not recycled.
+static int
+output_wait_zerocopy (struct output *out)
+{
+  int fd = out->request->ipcFd;
+  long deadline = now_ms () + OUTPUT_ZEROCOPY_WAIT;
+
+  while (out->zerocopy_pending > 0)
+    {
+      long left = deadline - now_ms ();
+      if (left <= 0)
+        {
+          debug ("zerocopy sends not completed in %d ms, resetting",
+                 OUTPUT_ZEROCOPY_WAIT);
+          struct linger reset = {.l_onoff = 1,.l_linger = 0 };
+          setsockopt (fd, SOL_SOCKET, SO_LINGER, &reset, sizeof (reset));
+          shutdown (fd, SHUT_RDWR);
+          errno = ETIMEDOUT;
+          return -1;
+        }
+
+      char control[128];
+      struct msghdr msg;
+      memset (&msg, 0, sizeof (msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+
+      if (recvmsg (fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+          if ((EAGAIN == errno) || (EINTR == errno))
+            {
+              struct pollfd pfd = {.fd = fd,.events = 0 };
+              int timeout = (left < 1000) ? left : 1000;
+              (void) poll (&pfd, 1, timeout);   // POLLERR is implied
+              continue;
+            }
+          return -1;
+        }
+
+      for (struct cmsghdr * cm = CMSG_FIRSTHDR (&msg); NULL != cm;
+           cm = CMSG_NXTHDR (&msg, cm))
+        {
+          struct sock_extended_err *serr =
+            (struct sock_extended_err *) CMSG_DATA (cm);
+          if (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin)
+            continue;
+          // notification covers sends [ee_info, ee_data]
+          size_t done = serr->ee_data - serr->ee_info + 1;
+          debug ("zerocopy completed %zu send(s)%s", done,
+                 (SO_EE_CODE_ZEROCOPY_COPIED == serr->ee_code) ?
+                 " (copied)" : "");
+          out->zerocopy_pending -=
+            (done > out->zerocopy_pending) ? out->zerocopy_pending : done;
+        }
+    }
+  return 0;
+}
+#endif
+
+
+static int
+output_send (struct output *out, struct iovec *iov, int iovcnt,
+             size_t bytes)
+{
+  int fd = out->request->ipcFd;
+  bool zerocopy = false;
+
+#ifdef USE_ZEROCOPY
+  if (bytes >= OUTPUT_ZEROCOPY_SIZE)
+    {
+      int one = 1;
+      // Fails on Unix sockets, just copy then
+      zerocopy =
+        (0 == setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one)));
+    }
+#endif
+
+  while (iovcnt > 0)
+    {
+      ssize_t rc = -1;
+      if (zerocopy)
+        {
+#ifdef USE_ZEROCOPY
+          struct msghdr msg;
+          memset (&msg, 0, sizeof (msg));
+          msg.msg_iov = iov;
+          msg.msg_iovlen = iovcnt;
+          rc = sendmsg (fd, &msg, MSG_ZEROCOPY);
+          if (rc >= 0)
+            out->zerocopy_pending++;
+#endif
+        }
+      else
+        rc = writev (fd, iov, iovcnt);
+
+      if (rc < 0)
+        {
+          if (EINTR == errno)
+            continue;
+          if ((ENOBUFS == errno) && zerocopy)
+            {
+              zerocopy = false;
+              continue;
+            }
+          return -1;
+        }
+
+      // Skip what was written, partial writes are possible
+      while ((iovcnt > 0) && ((size_t) rc >= iov->iov_len))
+        {
+          rc -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+      if (iovcnt > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + rc;
+          iov->iov_len -= rc;
+        }
+    }
+
+#ifdef USE_ZEROCOPY
+  if (zerocopy)
+    return output_wait_zerocopy (out);
+#endif
+  return 0;
+}
+
+
+// Send all complete chunks and put them aside for reuse
+static int
+output_flush (struct output *out)
+{
+  struct iovec iov[IOV_MAX < 64 ? IOV_MAX : 64];
+  int iovcnt = 0;
+  size_t bytes = 0;
+
+  debug ("sending %zu bytes", out->length);
+
+  int rc = 0;
+  enum timing_phase phase = timing_enter (TIMING_FLUSH);
+  struct output_chunk *chunk = out->head;
+  while (NULL != chunk)
+    {
+      struct output_chunk *next = chunk->next;
+      if (chunk->length > 0)
+        {
+          output_frame (out, chunk);
+          iov[iovcnt].iov_base = chunk->header;
+          iov[iovcnt].iov_len = FCGI_HEADER_LEN + chunk->length;
+          bytes += iov[iovcnt].iov_len;
+          iovcnt++;
+        }
+
+      if ((iovcnt == sizeof (iov) / sizeof (iov[0])) || (NULL == next))
+        {
+          if ((iovcnt > 0) && (0 != output_send (out, iov, iovcnt, bytes)))
+            {
+              rc = -1;
+              break;
+            }
+          iovcnt = 0;
+          bytes = 0;
+        }
+      chunk = next;
+    }
+  timing_enter (phase);
+  if (0 != rc)
+    {
+      // the kernel may still hold them, drop rather than reuse,
+      // and let no more writes into the last one
+      out->head = out->tail = NULL;
+      out->length = 0;
+      out->stream.wrNext = out->stream.stop = NULL;
+      return rc;
+    }
+
+  // all sent, recycle
+  if (NULL != out->head)
+    {
+      out->tail->next = out->spare;
+      out->spare = out->head;
+    }
+  out->head = out->tail = NULL;
+  out->length = 0;
+  return 0;
+}
+
+
+static int
+output_add_chunk (struct output *out)
+{
+  struct output_chunk *chunk = out->spare;
+  if (NULL != chunk)
+    out->spare = chunk->next;
+  else
+    chunk =
+      (struct output_chunk *) arena_alloc (request_arena,
+                                           sizeof (struct output_chunk));
+  if (NULL == chunk)
+    return -1;
+
+  chunk->next = NULL;
+  chunk->length = 0;
+  if (NULL == out->tail)
+    out->head = chunk;
+  else
+    out->tail->next = chunk;
+  out->tail = chunk;
+
+  out->stream.wrNext = chunk->data;
+  out->stream.stop = chunk->data + sizeof (chunk->data);
+  return 0;
+}
+
+
+// libfcgi calls it when the current chunk is full
+static void
+output_empty_buffer (FCGX_Stream * stream, int do_close)
+{
+  struct output *out = (struct output *) stream->data;
+  struct output_chunk *chunk = out->tail;
+
+  if (NULL != chunk)
+    {
+      size_t length = stream->wrNext - chunk->data;
+      out->length += length - chunk->length;
+      chunk->length = length;
+    }
+
+  if (do_close || stream->isClosed)
+    return;
+
+  if ((out->length >= OUTPUT_FLUSH_SIZE) && (0 != output_flush (out)))
+    {
+      output_error (out, errno);
+      return;
+    }
+
+  if (0 != output_add_chunk (out))
+    output_error (out, ENOMEM);
+}
+
+
+void
+output_begin (struct output *out, FCGX_Request * request)
+{
+  memset (out, 0, sizeof (*out));
+  out->request = request;
+  out->fcgi_out = request->out;
+
+  // Built-in listeners hand in a plain stream without
+  // FastCGI framing, handlers write to it as is
+  if (request->ipcFd < 0)
+    {
+      out->passthrough = true;
+      return;
+    }
+
+  out->stream.data = out;
+  out->stream.emptyBuffProc = output_empty_buffer;
+  // wrNext == stop, so the first write gets a chunk
+
+  request->out = &out->stream;
+}
+
+
+int
+output_end (struct output *out)
+{
+  int rc = 0;
+
+  if (out->passthrough)
+    return (0 != out->fcgi_out->FCGI_errno) ? -1 : 0;
+
+  output_empty_buffer (&out->stream, 1);
+
+  // libfcgi stream is left empty, FCGX_Finish_r() will send
+  // the end-of-stream record right after our records
+  if ((0 != out->stream.FCGI_errno) || (0 != output_flush (out)))
+    {
+      debug ("failed to send response");
+      rc = -1;
+    }
+
+  out->stream.isClosed = 1;
+  out->request->out = out->fcgi_out;
+  return rc;
+}
+
+
+static void
+output_buffer_grow (FCGX_Stream * stream, int do_close)
+{
+  struct output_buffer *buf = (struct output_buffer *) stream->data;
+
+  if (do_close || stream->isClosed)
+    return;
+
+  size_t length = stream->wrNext - buf->data;
+  size_t size = (0 == buf->size) ? 4096 : buf->size * 2;
+  unsigned char *data = (unsigned char *) realloc (buf->data, size);
+  if (NULL == data)
+    {
+      stream->isClosed = 1;
+      stream->FCGI_errno = ENOMEM;
+      return;
+    }
+
+  buf->data = data;
+  buf->size = size;
+  stream->wrNext = data + length;
+  stream->stop = data + size;
+}
+
+
+void
+output_buffer_init (struct output_buffer *buf)
+{
+  memset (buf, 0, sizeof (*buf));
+  buf->stream.data = buf;
+  buf->stream.emptyBuffProc = output_buffer_grow;
+}
+
+
+size_t
+output_buffer_length (const struct output_buffer *buf)
+{
+  return (NULL == buf->data) ? 0 : buf->stream.wrNext - buf->data;
+}
+
+
+int
+output_buffer_put (struct output_buffer *buf, FCGX_Stream * out)
+{
+  size_t length = output_buffer_length (buf);
+
+  if (0 == length)
+    return 0;
+  return (FCGX_PutStr ((const char *) buf->data, length, out) ==
+          (int) length) ? 0 : -1;
+}
+
+
+void
+output_buffer_free (struct output_buffer *buf)
+{
+  free (buf->data);
+  buf->data = NULL;
+  buf->size = 0;
+}
@@ -0,0 +1,68 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <fcgiapp.h>
+
+// Response body is collected into chunks laid out as FastCGI
+// FCGI_STDOUT records (8-byte header right before the content)
+// and sent to the web server with a single writev(), bypassing
+// libfcgi's own stream buffer.
+struct output_chunk;
+
+struct output
+{
+  FCGX_Stream stream;           // handlers write here via request->out
+  FCGX_Request *request;
+  FCGX_Stream *fcgi_out;        // libfcgi stream, restored by output_end()
+  struct output_chunk *head;
+  struct output_chunk *tail;
+  struct output_chunk *spare;   // sent chunks for reuse
+  size_t length;                // buffered content bytes
+  size_t zerocopy_pending;      // MSG_ZEROCOPY sends not completed yet
+  bool passthrough;             // not a FastCGI connection, see listener.c
+};
+
+void output_begin (struct output *, FCGX_Request *);
+int output_end (struct output *);
+
+// Growable memory stream for partial results produced
+// outside of the request thread, merged with output_buffer_put()
+struct output_buffer
+{
+  FCGX_Stream stream;
+  unsigned char *data;
+  size_t size;
+};
+
+void output_buffer_init (struct output_buffer *);
+size_t output_buffer_length (const struct output_buffer *);
+int output_buffer_put (struct output_buffer *, FCGX_Stream *);
+void output_buffer_free (struct output_buffer *);
+
+#endif // _OUTPUT_H
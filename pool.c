@@ -0,0 +1,260 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "debug.h"
+
+struct deque
+{
+  pthread_mutex_t lock;
+  struct pool_task *head;       // thieves take from here
+  struct pool_task *tail;       // owner pushes and pops here
+};
+
+// Tunable parameter, see --walk-threads:
+int pool_size = 4;
+
+static struct deque *deques = NULL;
+static int number_of_deques = 0;
+
+// Number of queued tasks, one may take a task only after
+// taking a unit of it, so a task is always found after that
+static pthread_mutex_t queued_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+static int queued = 0;
+
+static unsigned int next_deque = 0;     // round robin for outsiders
+static __thread int own_deque = -1;
+
+
+static void
+deque_push (struct deque *d, struct pool_task *task)
+{
+  pthread_mutex_lock (&d->lock);
+  task->next = NULL;
+  task->prev = d->tail;
+  if (NULL == d->tail)
+    d->head = task;
+  else
+    d->tail->next = task;
+  d->tail = task;
+  pthread_mutex_unlock (&d->lock);
+}
+
+
+static struct pool_task *
+deque_take (struct deque *d, int from_tail)
+{
+  pthread_mutex_lock (&d->lock);
+  struct pool_task *task = from_tail ? d->tail : d->head;
+  if (NULL != task)
+    {
+      if (NULL == task->prev)
+        d->head = task->next;
+      else
+        task->prev->next = task->next;
+      if (NULL == task->next)
+        d->tail = task->prev;
+      else
+        task->next->prev = task->prev;
+    }
+  pthread_mutex_unlock (&d->lock);
+  return task;
+}
+
+
+// The caller owns a unit of `queued'
+static struct pool_task *
+find_task (void)
+{
+  struct pool_task *task = NULL;
+
+  if (own_deque >= 0)
+    task = deque_take (&deques[own_deque], 1);
+
+  int start = (own_deque >= 0) ? own_deque : 0;
+  while (NULL == task)
+    for (int i = 1; (i <= number_of_deques) && (NULL == task); ++i)
+      task = deque_take (&deques[(start + i) % number_of_deques], 0);
+
+  return task;
+}
+
+
+static void
+run_task (struct pool_task *task)
+{
+  struct pool_batch *batch = task->batch;
+
+  task->run (task->arg);
+
+  pthread_mutex_lock (&batch->lock);
+  if (0 == --batch->pending)
+    pthread_cond_broadcast (&batch->done);
+  pthread_mutex_unlock (&batch->lock);
+}
+
+
+static void *
+pool_worker (void *param)
+{
+  own_deque = (intptr_t) param;
+  debug ("pool thread #%d started", own_deque);
+
+  while (1)
+    {
+      pthread_mutex_lock (&queued_lock);
+      while (0 == queued)
+        pthread_cond_wait (&queued_cond, &queued_lock);
+      queued--;
+      pthread_mutex_unlock (&queued_lock);
+
+      run_task (find_task ());
+    }
+  return NULL;
+}
+
+
+int
+pool_start (void)
+{
+  if (pool_size <= 0)
+    return 0;
+
+  deques = (struct deque *) calloc (pool_size, sizeof (struct deque));
+  if (NULL == deques)
+    return -1;
+
+  for (int i = 0; i < pool_size; ++i)
+    pthread_mutex_init (&deques[i].lock, NULL);
+  number_of_deques = pool_size;
+
+  for (int i = 0; i < pool_size; ++i)
+    {
+      pthread_t id;
+      int rc = pthread_create (&id, NULL, pool_worker, (void *) ((intptr_t) i));
+      if (0 != rc)
+        {
+          errno = rc;
+          return -1;
+        }
+      pthread_detach (id);
+    }
+  return 0;
+}
+
+
+int
+pool_running (void)
+{
+  return number_of_deques > 0;
+}
+
+
+void
+pool_batch_init (struct pool_batch *batch)
+{
+  pthread_mutex_init (&batch->lock, NULL);
+  pthread_cond_init (&batch->done, NULL);
+  batch->pending = 0;
+}
+
+
+void
+pool_submit (struct pool_batch *batch, struct pool_task *task,
+             void (*run) (void *), void *arg)
+{
+  task->run = run;
+  task->arg = arg;
+  task->batch = batch;
+
+  pthread_mutex_lock (&batch->lock);
+  batch->pending++;
+  pthread_mutex_unlock (&batch->lock);
+
+  if (!pool_running ())
+    {
+      run_task (task);
+      return;
+    }
+
+  int d = own_deque;
+  if (d < 0)
+    d = __sync_fetch_and_add (&next_deque, 1) % number_of_deques;
+  deque_push (&deques[d], task);
+
+  pthread_mutex_lock (&queued_lock);
+  queued++;
+  pthread_cond_signal (&queued_cond);
+  pthread_mutex_unlock (&queued_lock);
+}
+
+
+// Help with queued tasks (of any batch) instead of just sleeping
+void
+pool_wait (struct pool_batch *batch)
+{
+  while (1)
+    {
+      pthread_mutex_lock (&batch->lock);
+      int pending = batch->pending;
+      pthread_mutex_unlock (&batch->lock);
+      if (0 == pending)
+        break;
+
+      struct pool_task *task = NULL;
+      pthread_mutex_lock (&queued_lock);
+      if (queued > 0)
+        {
+          queued--;
+          pthread_mutex_unlock (&queued_lock);
+          task = find_task ();
+        }
+      else
+        pthread_mutex_unlock (&queued_lock);
+
+      if (NULL != task)
+        run_task (task);
+      else
+        {
+          pthread_mutex_lock (&batch->lock);
+          while (batch->pending > 0)
+            pthread_cond_wait (&batch->done, &batch->lock);
+          pthread_mutex_unlock (&batch->lock);
+        }
+    }
+
+  pthread_mutex_destroy (&batch->lock);
+  pthread_cond_destroy (&batch->done);
+}
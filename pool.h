@@ -0,0 +1,60 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+
+// Small work-stealing thread pool for splitting large requests.
+// Every pool thread has its own deque, idle threads steal from
+// the others, and a thread waiting for a batch runs queued tasks
+// as well, so nested or busy pools never deadlock.
+
+struct pool_batch
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int pending;
+};
+
+struct pool_task
+{
+  struct pool_task *prev;
+  struct pool_task *next;
+  void (*run) (void *);
+  void *arg;
+  struct pool_batch *batch;
+};
+
+extern int pool_size;
+
+int pool_start (void);
+int pool_running (void);
+
+void pool_batch_init (struct pool_batch *);
+void pool_submit (struct pool_batch *, struct pool_task *,
+                  void (*)(void *), void *);
+void pool_wait (struct pool_batch *);
+
+#endif // _POOL_H
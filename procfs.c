@@ -0,0 +1,144 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "procfs.h"
+#include "debug.h"
+
+static int proc_fd = -1;
+static pthread_once_t proc_once = PTHREAD_ONCE_INIT;
+static long page_size;
+static long clock_ticks;
+
+// Big enough for stat and the head of status
+static __thread char proc_buf[4096];
+
+
+static void
+proc_open (void)
+{
+  proc_fd = open ("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc_fd < 0)
+    debug ("cannot open /proc: %s", strerror (errno));
+  page_size = sysconf (_SC_PAGESIZE);
+  clock_ticks = sysconf (_SC_CLK_TCK);
+}
+
+
+// Reads the start of /proc/<name> into proc_buf,
+// returns 0 or an errno value (ENOENT for gone tasks)
+static int
+proc_read (const char *name)
+{
+  pthread_once (&proc_once, proc_open);
+  if (proc_fd < 0)
+    return ENOENT;
+
+  int fd = openat (proc_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+
+  ssize_t got;
+  do
+    got = read (fd, proc_buf, sizeof (proc_buf) - 1);
+  while ((got < 0) && (EINTR == errno));
+  int rc = (got < 0) ? errno : 0;
+  close (fd);
+
+  // A task that has just exited reads as empty
+  if (0 == got)
+    rc = ESRCH;
+  proc_buf[(got < 0) ? 0 : got] = '\0';
+  return rc;
+}
+
+
+// With `process' the whole thread group of the pid,
+// otherwise just the thread. Fields are from proc(5).
+int
+proc_task (pid_t pid, bool process, struct proc_task *task)
+{
+  char name[sizeof ("2147483647/task/2147483647/stat")];
+
+  if (process)
+    snprintf (name, sizeof (name), "%d/stat", pid);
+  else
+    snprintf (name, sizeof (name), "%d/task/%d/stat", pid, pid);
+
+  int rc = proc_read (name);
+  if (0 != rc)
+    return rc;
+
+  // "pid (comm) state ppid ...", comm may have spaces and parens
+  char *lparen = strchr (proc_buf, '(');
+  char *rparen = strrchr (proc_buf, ')');
+  if ((NULL == lparen) || (NULL == rparen) || (rparen < lparen))
+    return EINVAL;
+
+  size_t comm_len = rparen - lparen - 1;
+  if (comm_len >= sizeof (task->comm))
+    comm_len = sizeof (task->comm) - 1;
+  memcpy (task->comm, lparen + 1, comm_len);
+  task->comm[comm_len] = '\0';
+
+  unsigned long long utime, rss;
+  long threads;
+  // Fields 3 (state), 14 (utime), 20 (num_threads) and 24 (rss)
+  if (4 != sscanf (rparen + 2, "%c %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s "
+                   "%llu %*s %*s %*s %*s %*s %ld %*s %*s %*s %llu",
+                   &task->state, &utime, &threads, &rss))
+    return EINVAL;
+
+  task->pid = pid;
+  task->threads = threads;
+  task->rss = rss * page_size;
+  task->utime = utime * 1000 / clock_ticks;
+  return 0;
+}
+
+
+// Process (thread group) of the thread, -1 if it is gone
+pid_t
+proc_tgid (pid_t tid)
+{
+  char name[sizeof ("2147483647/status")];
+
+  snprintf (name, sizeof (name), "%d/status", tid);
+  if (0 != proc_read (name))
+    return -1;
+
+  char *tgid = strstr (proc_buf, "\nTgid:");
+  return (NULL == tgid) ? -1 : (pid_t) strtol (tgid + 6, NULL, 10);
+}
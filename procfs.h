@@ -0,0 +1,45 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _PROCFS_H
+#define _PROCFS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Process details from /proc, read relative to a /proc
+// descriptor opened once, into a buffer of the calling thread
+struct proc_task
+{
+  pid_t pid;
+  char comm[64];
+  char state;
+  long threads;
+  unsigned long long rss;       // bytes
+  unsigned long long utime;     // milliseconds
+};
+
+int proc_task (pid_t, bool, struct proc_task *);
+pid_t proc_tgid (pid_t);
+
+#endif // _PROCFS_H
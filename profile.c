@@ -0,0 +1,452 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#endif
+
+#include <fcgiapp.h>
+
+#include "arena.h"
+#include "dispatch.h"
+#include "profile.h"
+#include "timing.h"
+#include "debug.h"
+
+#define PROFILE_SECONDS 5       // unless ?seconds=N
+#define PROFILE_FREQUENCY 99    // samples per second of a busy thread
+#define PROFILE_PAGES 8         // ring buffer of a thread, power of 2
+#define PROFILE_DEPTH 64        // frames kept of a stack
+#define PROFILE_STACKS 4096     // distinct stacks, power of 2
+#define PROFILE_DRAIN_MS 100
+#define PROFILE_RECORD_MAX 65536        // perf_event_header.size is u16
+
+// Tunable parameter, see --profile-max:
+int profile_max_seconds = 0;    // disabled
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t *threads = NULL;
+static int number_of_threads = 0;
+
+// One profile at a time
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void
+profile_register (void)
+{
+  pid_t tid = (pid_t) syscall (SYS_gettid);
+
+  pthread_mutex_lock (&threads_lock);
+  pid_t *more =
+    (pid_t *) realloc (threads, sizeof (pid_t) * (number_of_threads + 1));
+  if (NULL != more)
+    {
+      threads = more;
+      threads[number_of_threads++] = tid;
+    }
+  pthread_mutex_unlock (&threads_lock);
+}
+
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+struct stack
+{
+  uint64_t hash;
+  uint64_t count;               // 0 is a free slot
+  uint32_t depth;
+  uint64_t *ips;                // leaf first
+};
+
+struct profile
+{
+  struct stack *stacks;         // PROFILE_STACKS slots
+  size_t used;
+  unsigned long samples;
+  unsigned long lost;           // by the kernel, the ring was full
+  unsigned long dropped;        // by us, the table was full
+  char *record;                 // a record wrapped around a ring
+};
+
+struct ring
+{
+  int fd;
+  struct perf_event_mmap_page *meta;
+  char *data;
+  size_t size;
+};
+
+
+static void
+profile_add (struct profile *p, const uint64_t * ips, uint64_t nr)
+{
+  uint64_t frames[PROFILE_DEPTH];
+  uint32_t depth = 0;
+  uint64_t hash = 14695981039346656037ULL;
+
+  p->samples++;
+  for (uint64_t i = 0; (i < nr) && (depth < PROFILE_DEPTH); i++)
+    {
+      // Skip PERF_CONTEXT_USER and the like
+      if (ips[i] >= PERF_CONTEXT_MAX)
+        continue;
+      frames[depth++] = ips[i];
+      hash = (hash ^ ips[i]) * 1099511628211ULL;
+    }
+  if (0 == depth)
+    {
+      p->dropped++;
+      return;
+    }
+
+  size_t mask = PROFILE_STACKS - 1;
+  for (size_t i = hash & mask, probes = 0; probes < PROFILE_STACKS;
+       i = (i + 1) & mask, probes++)
+    {
+      struct stack *s = &p->stacks[i];
+      if (0 == s->count)
+        {
+          // Keep probing sequences short
+          if (p->used >= PROFILE_STACKS / 4 * 3)
+            break;
+          s->ips = (uint64_t *) arena_alloc (request_arena,
+                                             depth * sizeof (uint64_t));
+          if (NULL == s->ips)
+            break;
+          memcpy (s->ips, frames, depth * sizeof (uint64_t));
+          s->hash = hash;
+          s->depth = depth;
+          s->count = 1;
+          p->used++;
+          return;
+        }
+      if ((s->hash == hash) && (s->depth == depth)
+          && (0 == memcmp (s->ips, frames, depth * sizeof (uint64_t))))
+        {
+          s->count++;
+          return;
+        }
+    }
+  p->dropped++;
+}
+
+
+static int
+ring_open (struct ring *r, pid_t tid, size_t page)
+{
+  struct perf_event_attr attr;
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_CPU_CLOCK;
+  attr.freq = 1;
+  attr.sample_freq = PROFILE_FREQUENCY;
+  attr.sample_type = PERF_SAMPLE_CALLCHAIN;
+  attr.sample_max_stack = PROFILE_DEPTH;
+  attr.disabled = 1;
+  // Own threads in user space only, allowed with perf_event_paranoid <= 2.
+  // The kernel follows frame pointers to unwind.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.exclude_callchain_kernel = 1;
+
+  r->fd = (int) syscall (SYS_perf_event_open, &attr, tid, -1, -1,
+                         PERF_FLAG_FD_CLOEXEC);
+  if (r->fd < 0)
+    return -1;
+
+  r->size = PROFILE_PAGES * page;
+  void *m = mmap (NULL, page + r->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  r->fd, 0);
+  if (MAP_FAILED == m)
+    {
+      int saved_errno = errno;
+      close (r->fd);
+      r->fd = -1;
+      errno = saved_errno;
+      return -1;
+    }
+  r->meta = (struct perf_event_mmap_page *) m;
+  r->data = (char *) m + page;
+  return 0;
+}
+
+
+static void
+ring_close (struct ring *r, size_t page)
+{
+  if (r->fd < 0)
+    return;
+  munmap (r->meta, page + r->size);
+  close (r->fd);
+  r->fd = -1;
+}
+
+
+static void
+ring_drain (struct ring *r, struct profile *p)
+{
+  uint64_t head = __atomic_load_n (&r->meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = r->meta->data_tail;
+
+  while (tail < head)
+    {
+      // Records are 8-byte aligned, a header never wraps
+      size_t offset = tail & (r->size - 1);
+      struct perf_event_header *h =
+        (struct perf_event_header *) (r->data + offset);
+      size_t len = h->size;
+      if (len < sizeof (*h))
+        break;
+      if (offset + len > r->size)
+        {
+          size_t first = r->size - offset;
+          memcpy (p->record, r->data + offset, first);
+          memcpy (p->record + first, r->data, len - first);
+          h = (struct perf_event_header *) p->record;
+        }
+
+      const uint64_t *body = (const uint64_t *) (h + 1);
+      if (PERF_RECORD_SAMPLE == h->type)
+        {
+          // u64 nr, u64 ips[nr]
+          uint64_t nr = body[0];
+          if (sizeof (*h) + (nr + 1) * sizeof (uint64_t) <= len)
+            profile_add (p, body + 1, nr);
+        }
+      else if (PERF_RECORD_LOST == h->type)
+        p->lost += body[1];     // u64 id, u64 lost
+
+      tail += len;
+    }
+
+  __atomic_store_n (&r->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+
+static long
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+// Samples all threads, returns the number of them or -1
+static int
+profile_run (struct profile *p, long seconds)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+
+  pthread_mutex_lock (&threads_lock);
+  int n = number_of_threads;
+  pid_t *tids = (pid_t *) arena_alloc (request_arena, n * sizeof (pid_t));
+  if (NULL != tids)
+    memcpy (tids, threads, n * sizeof (pid_t));
+  pthread_mutex_unlock (&threads_lock);
+
+  struct ring *rings =
+    (struct ring *) arena_alloc (request_arena, n * sizeof (struct ring));
+  if ((NULL == tids) || (NULL == rings))
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  int opened = 0;
+  for (int i = 0; i < n; i++)
+    {
+      if (0 == ring_open (&rings[i], tids[i], page))
+        opened++;
+      else if (ESRCH != errno)
+        {
+          int saved_errno = errno;
+          debug ("perf_event_open() for thread %d failed: %s", (int) tids[i],
+                 strerror (errno));
+          for (int j = 0; j < i; j++)
+            ring_close (&rings[j], page);
+          errno = saved_errno;
+          return -1;
+        }
+    }
+
+  debug ("profiling %d threads for %ld s", opened, seconds);
+  for (int i = 0; i < n; i++)
+    if (rings[i].fd >= 0)
+      ioctl (rings[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+
+  long deadline = now_ms () + seconds * 1000;
+  for (long left; (left = deadline - now_ms ()) > 0;)
+    {
+      poll (NULL, 0, (left < PROFILE_DRAIN_MS) ? left : PROFILE_DRAIN_MS);
+      for (int i = 0; i < n; i++)
+        if (rings[i].fd >= 0)
+          ring_drain (&rings[i], p);
+    }
+
+  for (int i = 0; i < n; i++)
+    if (rings[i].fd >= 0)
+      {
+        ioctl (rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+        ring_drain (&rings[i], p);
+        ring_close (&rings[i], page);
+      }
+
+  return opened;
+}
+
+
+// Function name if exported (link with -rdynamic), else module+offset
+static void
+put_frame (FCGX_Stream * out, uint64_t ip)
+{
+  Dl_info info;
+  if (0 == dladdr ((void *) (uintptr_t) ip, &info))
+    FCGX_FPrintF (out, "0x%lx", (unsigned long) ip);
+  else if (NULL != info.dli_sname)
+    FCGX_PutS (info.dli_sname, out);
+  else
+    {
+      const char *base = strrchr (info.dli_fname, '/');
+      FCGX_FPrintF (out, "%s+0x%lx",
+                    (NULL == base) ? info.dli_fname : base + 1,
+                    (unsigned long) (ip - (uintptr_t) info.dli_fbase));
+    }
+}
+
+
+// Folded stacks, "root;...;leaf count" per line, for flamegraph.pl
+static void
+profile_print (FCGX_Stream * out, const struct profile *p)
+{
+  for (size_t i = 0; i < PROFILE_STACKS; i++)
+    {
+      const struct stack *s = &p->stacks[i];
+      if (0 == s->count)
+        continue;
+      for (uint32_t d = s->depth; d-- > 0;)
+        {
+          // Return addresses point past the call
+          put_frame (out, (0 == d) ? s->ips[d] : s->ips[d] - 1);
+          FCGX_PutChar ((0 == d) ? ' ' : ';', out);
+        }
+      FCGX_FPrintF (out, "%lu\n", (unsigned long) s->count);
+    }
+  if (0 != p->lost)
+    FCGX_FPrintF (out, "[lost] %lu\n", p->lost);
+  if (0 != p->dropped)
+    FCGX_FPrintF (out, "[dropped] %lu\n", p->dropped);
+}
+
+#endif // HAVE_LINUX_PERF_EVENT_H
+
+
+// tail is what follows /debug/, e. g. "profile?seconds=10"
+void
+fcgi_profile (FCGX_Request * request, char *tail)
+{
+  size_t len = strcspn (tail, "/?");
+  if ((7 != len) || (0 != strncmp ("profile", tail, len)))
+    {
+      report_error (request, "Unknown request: debug/%.*s", (int) len, tail);
+      return;
+    }
+  if (0 == profile_max_seconds)
+    {
+      report_error (request, "Profiling is disabled, see --profile-max");
+      return;
+    }
+
+  long seconds = PROFILE_SECONDS;
+  char *param_tail = NULL;
+  char *query = strchr (tail, '?');
+  for (char *param = (NULL == query) ? NULL :
+       strtok_r (query + 1, "&", &param_tail); NULL != param;
+       param = strtok_r (NULL, "&", &param_tail))
+    if (0 == strncmp ("seconds=", param, 8))
+      {
+        char *p;
+        seconds = strtol (param + 8, &p, 10);
+        if ('\0' != *p)
+          seconds = -1;
+      }
+  if ((seconds <= 0) || (seconds > profile_max_seconds))
+    {
+      report_error (request, "Seconds must be 1 to %d", profile_max_seconds);
+      return;
+    }
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  if (0 != pthread_mutex_trylock (&profile_lock))
+    {
+      report_error (request, "Another profile is running");
+      return;
+    }
+
+  struct profile p;
+  memset (&p, 0, sizeof (p));
+  p.stacks = (struct stack *) arena_alloc (request_arena,
+                                           PROFILE_STACKS *
+                                           sizeof (struct stack));
+  p.record = (char *) arena_alloc (request_arena, PROFILE_RECORD_MAX);
+  if ((NULL == p.stacks) || (NULL == p.record))
+    report_error (request, "Out of memory");
+  else
+    {
+      memset (p.stacks, 0, PROFILE_STACKS * sizeof (struct stack));
+      enum timing_phase phase = timing_enter (TIMING_BACKEND);
+      int rc = profile_run (&p, seconds);
+      timing_enter (phase);
+      if (rc < 0)
+        report_error (request, "perf_event_open: %s", strerror (errno));
+      else
+        {
+          debug ("%lu samples, %zu stacks, %lu lost, %lu dropped",
+                 p.samples, p.used, p.lost, p.dropped);
+          profile_print (request->out, &p);
+        }
+    }
+  pthread_mutex_unlock (&profile_lock);
+#else
+  report_error (request, "Profiling is not supported on this system");
+#endif
+}
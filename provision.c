@@ -0,0 +1,223 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "provision.h"
+#include "debug.h"
+
+// Tasks may be forked into a group while it is being emptied
+#define MIGRATE_ATTEMPTS 3
+
+
+// One mkdirat() when the parent exists, else one per
+// missing component. With `parents' an existing group is fine.
+int
+group_mkdir (int root, const char *path, bool parents)
+{
+  if (0 == mkdirat (root, path, 0755))
+    return 0;
+  if (!parents || ((EEXIST != errno) && (ENOENT != errno)))
+    return errno;
+  if (EEXIST == errno)
+    return 0;
+
+  char buf[strlen (path) + 1];
+  strcpy (buf, path);
+  for (char *slash = strchr (buf, '/'); NULL != slash;
+       slash = strchr (slash + 1, '/'))
+    {
+      *slash = '\0';
+      if ((0 != mkdirat (root, buf, 0755)) && (EEXIST != errno))
+        return errno;
+      *slash = '/';
+    }
+
+  if ((0 != mkdirat (root, buf, 0755)) && (EEXIST != errno))
+    return errno;
+  return 0;
+}
+
+
+// Moves every task of the group to the one `to' is the
+// tasks file of. The kernel takes one pid per write().
+static int
+migrate_tasks (int dir, int to)
+{
+  int from = openat (dir, "tasks", O_RDONLY | O_CLOEXEC);
+  if (from < 0)
+    return errno;
+
+  char buf[4096];
+  size_t kept = 0;              // a pid split between reads
+  int rc = 0;
+  while (0 == rc)
+    {
+      ssize_t got = read (from, buf + kept, sizeof (buf) - kept - 1);
+      if ((got < 0) && (EINTR == errno))
+        continue;
+      if (got < 0)
+        {
+          rc = errno;
+          break;
+        }
+      if (0 == got)
+        break;
+
+      size_t end = kept + got;
+      buf[end] = '\0';
+      char *pid = buf;
+      char *nl;
+      while ((0 == rc) && (NULL != (nl = strchr (pid, '\n'))))
+        {
+          // Tasks exit meanwhile, that is fine
+          if ((write (to, pid, nl - pid) < 0) && (ESRCH != errno))
+            rc = errno;
+          pid = nl + 1;
+        }
+      kept = buf + end - pid;
+      memmove (buf, pid, kept);
+    }
+
+  close (from);
+  return rc;
+}
+
+
+static int remove_group (int, const char *, bool, int);
+
+static int
+remove_subgroups (int dir, int to)
+{
+  int fd = dup (dir);
+  DIR *d = (fd < 0) ? NULL : fdopendir (fd);
+  if (NULL == d)
+    {
+      int rc = errno;
+      if (fd >= 0)
+        close (fd);
+      return rc;
+    }
+
+  int rc = 0;
+  struct dirent *entry;
+  while ((0 == rc) && (NULL != (entry = readdir (d))))
+    {
+      if ((0 == strcmp (".", entry->d_name))
+          || (0 == strcmp ("..", entry->d_name)))
+        continue;
+
+      // Groups are the only directories there
+      bool is_dir = (DT_DIR == entry->d_type);
+      if (DT_UNKNOWN == entry->d_type)
+        {
+          struct stat st;
+          is_dir = (0 == fstatat (dir, entry->d_name, &st,
+                                  AT_SYMLINK_NOFOLLOW))
+            && S_ISDIR (st.st_mode);
+        }
+      if (is_dir)
+        rc = remove_group (dir, entry->d_name, true, to);
+    }
+
+  closedir (d);
+  return rc;
+}
+
+
+// Subgroups go first, then the tasks of the group go to `to'
+// (if not -1), then the group itself
+static int
+remove_group (int parent, const char *name, bool recursive, int to)
+{
+  int dir = -1;
+  if (recursive || (to >= 0))
+    {
+      dir = openat (parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                    | O_CLOEXEC);
+      if (dir < 0)
+        return errno;
+    }
+
+  int rc = recursive ? remove_subgroups (dir, to) : 0;
+  for (int attempt = 0; 0 == rc; ++attempt)
+    {
+      if (to >= 0)
+        rc = migrate_tasks (dir, to);
+      if (0 != rc)
+        break;
+
+      if (0 == unlinkat (parent, name, AT_REMOVEDIR))
+        break;
+      rc = errno;
+      if ((EBUSY == rc) && (to >= 0) && (attempt + 1 < MIGRATE_ATTEMPTS))
+        rc = 0;
+    }
+
+  if (dir >= 0)
+    close (dir);
+  return rc;
+}
+
+
+// A single unlinkat() unless the group has subgroups
+// (`recursive') or tasks to move to the parent (`migrate')
+int
+group_rmdir (int root, const char *path, bool recursive, bool migrate)
+{
+  int to = -1;
+  if (migrate)
+    {
+      const char *slash = strrchr (path, '/');
+      char tasks[strlen (path) + sizeof ("/tasks")];
+      if (NULL == slash)
+        strcpy (tasks, "tasks");
+      else
+        sprintf (tasks, "%.*s/tasks", (int) (slash - path), path);
+
+      to = openat (root, tasks, O_WRONLY | O_CLOEXEC);
+      if (to < 0)
+        return errno;
+    }
+
+  debug ("removing `%s'%s%s", path, recursive ? " recursively" : "",
+         migrate ? ", moving tasks up" : "");
+  int rc = remove_group (root, path, recursive, to);
+
+  if (to >= 0)
+    close (to);
+  return rc;
+}
@@ -0,0 +1,206 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+// Static probes compile to nothing without SystemTap headers
+#define DTRACE_PROBE2(provider, name, a, b) ((void) 0)
+#define DTRACE_PROBE3(provider, name, a, b, c) ((void) 0)
+#endif
+
+#include "arena.h"
+#include "timing.h"
+#include "debug.h"
+
+// Tunable parameters, see --slow-log and --slow-log-sample:
+long slow_request_ms = 0;       // off
+int slow_request_sample = 1;    // log every slow request
+
+__thread struct timing *request_timing = NULL;
+
+static unsigned long requests = 0;
+static unsigned long slow_requests = 0;
+
+static const char *const phase_names[TIMING_PHASES] = {
+  "accept",
+  "parse",
+  "route",
+  "backend",
+  "serialize",
+  "flush"
+};
+
+
+static long
+elapsed_ns (const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000000L
+    + (to->tv_nsec - from->tv_nsec);
+}
+
+
+// Charges the time since the last mark to the current phase
+static void
+timing_account (struct timing *t)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  t->ns[t->phase] += elapsed_ns (&t->mark, &now);
+  t->mark = now;
+}
+
+
+// Makes the timer current and starts waiting for a request
+void
+timing_start (struct timing *t)
+{
+  memset (t, 0, sizeof (*t));
+  t->phase = TIMING_ACCEPT;
+  clock_gettime (CLOCK_MONOTONIC, &t->mark);
+  request_timing = t;
+}
+
+
+void
+timing_accepted (const char *uri)
+{
+  struct timing *t = request_timing;
+  if (NULL == t)
+    return;
+
+  t->id = __sync_add_and_fetch (&requests, 1);
+  t->uri = (NULL == uri) ? NULL : arena_strdup (request_arena, uri);
+  DTRACE_PROBE2 (fcgi, request_start, t->id, t->uri);
+  timing_enter (TIMING_PARSE);
+}
+
+
+// Returns the phase left, to get back to it after a nested one
+enum timing_phase
+timing_enter (enum timing_phase phase)
+{
+  struct timing *t = request_timing;
+  if (NULL == t)
+    return phase;
+
+  enum timing_phase previous = t->phase;
+  if (phase != previous)
+    {
+      timing_account (t);
+      t->phase = phase;
+      DTRACE_PROBE3 (fcgi, phase, t->id, phase, previous);
+    }
+  return previous;
+}
+
+
+// Without the accept phase, that is mostly waiting
+// for the next request on an idle server
+long
+timing_total_us (const struct timing *t)
+{
+  long ns = 0;
+  for (int i = TIMING_PARSE; i < TIMING_PHASES; i++)
+    ns += t->ns[i];
+  return ns / 1000;
+}
+
+
+// Server-Timing header, durations are in milliseconds
+void
+timing_print (FCGX_Stream * out, const struct timing *t)
+{
+  FCGX_PutS ("Server-Timing: ", out);
+  for (int i = 0; i < TIMING_PHASES; i++)
+    {
+      long us = t->ns[i] / 1000;
+      FCGX_FPrintF (out, "%s;dur=%ld.%03ld, ", phase_names[i], us / 1000,
+                    us % 1000);
+    }
+  long total = timing_total_us (t);
+  FCGX_FPrintF (out, "total;dur=%ld.%03ld\r\n", total / 1000, total % 1000);
+}
+
+
+static void
+log_slow_request (const struct timing *t, int status, long total)
+{
+  time_t ltime = time (NULL);
+  struct tm tm;
+  char time_str[32];
+  char buf[1024];
+
+  // Any worker thread may log at the same time
+  strftime (time_str, sizeof (time_str), "%Y-%m-%d %T %z",
+            localtime_r (&ltime, &tm));
+
+  int bytes = snprintf (buf, sizeof (buf),
+                        "%s slow request #%lu `%s', status %d, %ld.%03ld ms:",
+                        time_str, t->id, (NULL == t->uri) ? "" : t->uri,
+                        status, total / 1000, total % 1000);
+  for (int i = 0; (i < TIMING_PHASES) && (bytes < (int) sizeof (buf)); i++)
+    {
+      long us = t->ns[i] / 1000;
+      bytes += snprintf (buf + bytes, sizeof (buf) - bytes, " %s %ld.%03ld",
+                         phase_names[i], us / 1000, us % 1000);
+    }
+  if (bytes < (int) sizeof (buf) - 1)
+    bytes += snprintf (buf + bytes, sizeof (buf) - bytes, "\n");
+  else
+    strcpy (buf + sizeof (buf) - 5, "...\n");
+
+  (void) write (2, buf, strlen (buf));
+}
+
+
+// Called when the response is completely sent,
+// the timer stops being current
+void
+timing_finish (int status)
+{
+  struct timing *t = request_timing;
+  if (NULL == t)
+    return;
+
+  timing_account (t);
+  long total = timing_total_us (t);
+  DTRACE_PROBE3 (fcgi, request_done, t->id, status, total);
+
+  debug ("request #%lu took %ld us", t->id, total);
+  if ((slow_request_ms > 0) && (total >= slow_request_ms * 1000)
+      && (0 == __sync_add_and_fetch (&slow_requests, 1)
+          % slow_request_sample))
+    log_slow_request (t, status, total);
+
+  request_timing = NULL;
+}
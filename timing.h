@@ -0,0 +1,69 @@
+/* 
+Copyright (c) 2014 Igor Pashev <pashev.igor@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <time.h>
+
+#include <fcgiapp.h>
+
+// Where a request spends its time, phases follow
+// one another, nested ones are undone by timing_enter()
+// with the phase it has returned
+enum timing_phase
+{
+  TIMING_ACCEPT,                // accept_mutex and FCGX_Accept_r()
+  TIMING_PARSE,                 // request parameters and query
+  TIMING_ROUTE,                 // picking the driver
+  TIMING_BACKEND,               // libcgroup and /proc
+  TIMING_SERIALIZE,             // formatting the response
+  TIMING_FLUSH,                 // sending it
+  TIMING_PHASES
+};
+
+struct timing
+{
+  unsigned long id;             // request number in this process
+  const char *uri;              // copy in the request arena
+  enum timing_phase phase;
+  struct timespec mark;         // when the current phase began
+  long ns[TIMING_PHASES];
+};
+
+// Timer of the request served by the current worker thread,
+// NULL elsewhere, which turns all calls below into no-ops
+extern __thread struct timing *request_timing;
+
+extern long slow_request_ms;
+extern int slow_request_sample;
+
+void timing_start (struct timing *);
+void timing_accepted (const char *);
+enum timing_phase timing_enter (enum timing_phase);
+void timing_finish (int);
+
+long timing_total_us (const struct timing *);
+void timing_print (FCGX_Stream *, const struct timing *);
+
+#endif // _TIMING_H
@@ -24,6 +24,11 @@ THE SOFTWARE.
 #include "config.h"
 #endif
 
+#include <ctype.h>
+#include <stdlib.h>
+
+#include "uri.h"
+
 #ifndef URI_PREFIX
 #define URI_PREFIX "/fcgi"
 #endif
@@ -32,3 +37,27 @@ static const char uri_prefix_default[] = URI_PREFIX;
 
 const char *uri_prefix = uri_prefix_default;
 int uri_prefix_len = sizeof (uri_prefix_default) - 1;
+
+
+// Decodes "%2A" and "+" in place
+void
+uri_unescape (char *str)
+{
+  char *dst = str;
+
+  for (char *src = str; '\0' != *src; src++, dst++)
+    {
+      if (('%' == src[0]) && isxdigit ((unsigned char) src[1])
+          && isxdigit ((unsigned char) src[2]))
+        {
+          char hex[3] = { src[1], src[2], '\0' };
+          *dst = (char) strtol (hex, NULL, 16);
+          src += 2;
+        }
+      else if ('+' == *src)
+        *dst = ' ';
+      else
+        *dst = *src;
+    }
+  *dst = '\0';
+}
@@ -26,4 +26,6 @@ THE SOFTWARE.
 extern const char *uri_prefix;
 extern int uri_prefix_len;
 
+void uri_unescape (char *);
+
 #endif // _URI_H